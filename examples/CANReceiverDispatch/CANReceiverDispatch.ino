@@ -0,0 +1,71 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <CAN.h>
+#include <CANDispatcher.h>
+
+// Receives frames through per-ID handlers instead of a single callback that
+// has to check packetId() for every frame.
+
+struct Counter {
+  const char* name;
+  unsigned long count;
+};
+
+Counter obdRequests = { "OBD-II request", 0 };
+Counter obdReplies = { "OBD-II reply", 0 };
+
+CANDispatchSlot dispatchSlots[8];
+CANDispatcher dispatcher(dispatchSlots, 8);
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial);
+
+  Serial.println("CAN Receiver Dispatch");
+
+  // start the CAN bus at 500 kbps
+  if (!CAN.begin(500E3)) {
+    Serial.println("Starting CAN failed!");
+    while (1);
+  }
+
+  CAN.setDispatcher(&dispatcher);
+
+  // 0x7DF is the functional OBD-II request ID, ECUs reply on 0x7E8-0x7EF.
+  CAN.onReceive(0x7DF, countFrame, &obdRequests);
+  CAN.onReceive(0x7E8, 0x7F8, countFrame, &obdReplies);
+  CAN.onReceiveExtended(0x18DAF100, 0x1FFFFF00, printFrame);
+
+  // Frames without a handler end up in the regular callback.
+  CAN.onReceive(onReceive);
+}
+
+void loop() {
+  Serial.print(obdRequests.name);
+  Serial.print("s: ");
+  Serial.print(obdRequests.count);
+  Serial.print(", ");
+  Serial.print(obdReplies.name);
+  Serial.print("s: ");
+  Serial.println(obdReplies.count);
+
+  delay(1000);
+}
+
+void countFrame(const CANFrame& /*frame*/, void* context) {
+  Counter* counter = (Counter*)context;
+  counter->count++;
+}
+
+void printFrame(const CANFrame& frame, void* /*context*/) {
+  Serial.print("Extended diagnostic frame from 0x");
+  Serial.println(frame.id, HEX);
+}
+
+void onReceive(int packetSize) {
+  Serial.print("Other packet with id 0x");
+  Serial.print(CAN.packetId(), HEX);
+  Serial.print(" and length ");
+  Serial.println(packetSize);
+}
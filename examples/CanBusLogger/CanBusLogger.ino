@@ -0,0 +1,59 @@
+#include <CAN.h>
+#include <CANLogger.h>
+
+// This is a demo program that captures all messages on the CAN bus into a
+// compact binary log written to Serial. Unlike CanBusMonitor, which prints
+// every frame as text, it can keep up with a much busier bus.
+//
+// Decode the capture on the host with:
+//   extras/canlog_decode.py capture.bin > capture.log
+// and feed the result to can-utils, e.g. `canplayer -I capture.log`.
+//
+// The same logger can write to any Print, e.g. an SD card File.
+//
+// Connections:
+//  MCP | BOARD
+//  INT | Pin 9
+//  SCK | SCK
+//   SI | MO
+//   SO | MI
+//   CS | Pin 7
+//  GND | GND
+//  VCC | 3.3V
+
+const int CS_PIN = 7;
+const int IRQ_PIN = 9;
+const int QUARTZ_MHZ = 16;  // Some MCP2515 boards have 8 MHz quartz.
+const int SPI_MHZ = 10;
+
+uint8_t logBuffers[2 * CAN_LOGGER_BUFFER_SIZE];
+CANLogger logger(logBuffers, CAN_LOGGER_BUFFER_SIZE);
+
+void setup() {
+  // Use the fastest baud rate the host link supports; native USB boards
+  // ignore it altogether.
+  Serial.begin(1000000);
+  while (!Serial);
+
+  CAN.setClockFrequency(QUARTZ_MHZ * 1E6);
+  CAN.setSPIFrequency(SPI_MHZ * 1E6);
+  CAN.setPins(CS_PIN, IRQ_PIN);
+
+  while (!CAN.begin(500000)) {
+    delay(1000);
+  }
+
+  logger.begin(Serial);
+
+  // Frames are captured from the interrupt, while loop() writes the filled
+  // buffers out.
+  CAN.onReceive(onReceive);
+}
+
+void onReceive(int /*packetSize*/) {
+  logger.logPacket(CAN);
+}
+
+void loop() {
+  logger.poll();
+}
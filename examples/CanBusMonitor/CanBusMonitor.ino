@@ -1,4 +1,5 @@
 #include <CAN.h>
+#include <CANChangeFilter.h>
 
 // This is a demo program that listens to messages on the CAN bus and prints them out to Serial.
 //
@@ -21,6 +22,11 @@ const int IRQ_PIN = 9;
 const int QUARTZ_MHZ = 16;  // Some MCP2515 boards have 8 MHz quartz.
 const int SPI_MHZ = 16;
 
+// Most frames on a car's bus repeat the same payload over and over, so only
+// print frames whose payload changed, plus every ID once every 5 seconds.
+CANChangeFilterSlot change_filter_slots[64];
+CANChangeFilter change_filter(change_filter_slots, 64);
+
 void setup() {
   Serial.begin(115200);
 
@@ -40,6 +46,12 @@ void setup() {
   }
 
   Serial.println("CAN controller connected");
+
+  change_filter.setHeartbeat(5000);
+  // Optional: add something like
+  //   change_filter.setIgnoredBytes(0x140, 0x80);
+  // to ignore bytes that change all the time, e.g. rolling counters.
+  CAN.setChangeFilter(&change_filter);
 }
 
 // Forward declarations for helper functions.
@@ -79,9 +91,6 @@ void handle_message(uint32_t packet_id, uint8_t *data, int data_length) {
   //   }
   // to only show a subset of messages that match a certain criteria.
 
-  // TODO: Add something smart to avoid spamming Serial.
-  // For example, limit the number of messages printed over 10 seconds to 25?
-
   Serial.print("0x");
   Serial.print(packet_id, HEX);
   Serial.print(", data:");
@@ -1,4 +1,5 @@
 #include <CAN.h>
+#include <CANSignal.h>
 
 // This is a demo program that sends messages over the CAN bus in
 // a way that resembles real messages you can receive if you listen
@@ -26,6 +27,39 @@ const int IRQ_PIN = 9;
 const int QUARTZ_MHZ = 16;  // Some MCP2515 boards have 8 MHz quartz.
 const int SPI_MHZ = 8;
 
+const CANAutoResponse AUTO_RESPONSES[] = {
+  // 0x7C0 / 0x2129 — Returns fuel level in liters x2.
+  { 0x7C0, false, false, 3, { 0x02, 0x21, 0x29 },
+    { 0x7C8, false, false, 8, { 0x03, 0x61, 0x29, 0x1C } } },
+  // 0x7DF / 0x010F — Returns (intake temperature in ºC + 40)
+  { 0x7DF, false, false, 3, { 0x02, 0x01, 0x0F },
+    { 0x7E8, false, false, 8, { 0x03, 0x41, 0x0F, 40 + 36 } } },  // 36 ºC
+  // 0x7DF / 0x0146 — Returns (air temperature in ºC + 40)
+  { 0x7DF, false, false, 3, { 0x02, 0x01, 0x46 },
+    { 0x7E8, false, false, 8, { 0x03, 0x41, 0x46, 40 + 27 } } },  // 27 ºC
+  // TPMS pressures request. Only the first frame of the reply is sent from
+  // here, the continuation frame is sent from loop() once it is acked.
+  { 0x750, false, false, 4, { 0x2a, 0x02, 0x21, 0x30 },
+    { 0x758, false, false, 8, {
+      0x2a,
+      0x10,  // "1" means "first frame in a sequence"
+      0x07, 0x61, 0x30,
+      0xAB,  // FL tire pressure
+      0xAC,  // FR tire pressure
+      0xAD,  // RR tire pressure
+    } } },
+  // TPMS temperatures request.
+  { 0x750, false, false, 4, { 0x2a, 0x02, 0x21, 0x16 },
+    { 0x758, false, false, 8, {
+      0x2a,
+      0x10,  // "1" means "first frame in a sequence"
+      0x07, 0x61, 0x16,
+      40 + 21,  // FL tire temperature: 21ºC
+      40 + 22,  // FR tire temperature
+      40 + 23,  // RR tire temperature
+    } } },
+};
+
 void setup() {
   Serial.begin(115200);
 
@@ -48,6 +82,12 @@ void setup() {
   }
 
   Serial.println("CAN controller connected");
+
+  // Simple single-frame diagnostic requests are answered by the driver as
+  // parsePacket() reads them in loop(), without an extra SPI round trip.
+  if (!CAN.setAutoResponses(AUTO_RESPONSES, sizeof(AUTO_RESPONSES) / sizeof(AUTO_RESPONSES[0]))) {
+    Serial.println("Failed to set up auto-responses");
+  }
 }
 
 class FakeTpmsEcu {
@@ -201,54 +241,12 @@ void try_to_receive_data() {
     data[data_length++] = byte_read;
   }
 
-  if (id == 0x7C0 && data[0] == 0x2 && data[1] == 0x21 && data[2] == 0x29) {
-    // 0x7C0 / 0x2129 — Returns fuel level in liters x2.
-    uint8_t response[8] = {0};
-    response[0] = 0x3;
-    response[1] = 0x61;
-    response[2] = 0x29;
-    response[3] = 0x1C;
-    send_data(0x7C8, response, 8);
-    return;
-  }
-
-  if (id == 0x7DF && data[0] == 0x2 && data[1] == 0x01 && data[2] == 0x0f) {
-    // 0x7DF / 0x010F — Returns (intake temperature in ºC + 40)
-    uint8_t response[8] = {0};
-    response[0] = 0x3;
-    response[1] = 0x41;
-    response[2] = 0x0f;
-    response[3] = 40 + 36;  // 36 ºC
-    send_data(0x7E8, response, 8);
-    return;
-  }
-
-  if (id == 0x7DF && data[0] == 0x2 && data[1] == 0x01 && data[2] == 0x46) {
-    // 0x7DF / 0x0146 — Returns (air temperature in ºC + 40)
-    uint8_t response[8] = {0};
-    response[0] = 0x3;
-    response[1] = 0x41;
-    response[2] = 0x46;
-    response[3] = 40 + 27;  // 27 ºC
-    send_data(0x7E8, response, 8);
-    return;
-  }
-
   if (id == 0x750 && data_length >= 1 && data[0] == 0x2a) {
     if (data_length >= 3 && data[1] == 0x02 && data[2] == 0x21) {
       if (data[3] == 0x30) {
-        // TPMS pressures request.
+        // TPMS pressures request. The first frame of the reply has already
+        // been sent by the auto-responder.
         uint8_t response[8] = {0};
-        response[0] = 0x2a;
-        response[1] = 0x10;  // "1" means "first frame in a sequence"
-        response[2] = 0x07;
-        response[3] = 0x61;
-        response[4] = 0x30;
-        response[5] = 0xAB;  // FL tire pressure
-        response[6] = 0xAC;  // FR tire pressure
-        response[7] = 0xAD;  // RR tire pressure
-        send_data(0x758, response, 8);
-
         response[0] = 0x2a;
         response[1] = 0x21;  // "2" means "continuation frame", "1" means "first continuation frame".
         response[2] = 0xAE;  // RL tire pressure
@@ -259,18 +257,9 @@ void try_to_receive_data() {
         response[7] = 0x00;
         fake_tpms_ecu.scheduleNextFrame(0x758, response, 8);
       } else if (data[3] == 0x16) {
-        // TPMS temperatures request.
+        // TPMS temperatures request. The first frame of the reply has already
+        // been sent by the auto-responder.
         uint8_t response[8] = {0};
-        response[0] = 0x2a;
-        response[1] = 0x10;  // "1" means "first frame in a sequence"
-        response[2] = 0x07;
-        response[3] = 0x61;
-        response[4] = 0x16;
-        response[5] = 40 + 21;  // FL tire temperature: 21ºC
-        response[6] = 40 + 22;  // FR tire temperature
-        response[7] = 40 + 23;  // RR tire temperature
-        send_data(0x758, response, 8);
-
         response[0] = 0x2a;
         response[1] = 0x21;  // "2" means "continuation frame", "1" means "first continuation frame".
         response[2] = 40 + 24;  // RL tire temperature
@@ -287,103 +276,103 @@ void try_to_receive_data() {
   }
 }
 
+// Signals of the messages below, as decoded so far. See CANSignal.h for the
+// meaning of the template arguments (start bit, length, byte order, signed,
+// factor numerator / denominator, offset).
+
+// 0xD0 contains the steering wheel angle and data from motion sensors.
+struct MotionMessage : CANMessage<0xD0> {
+  typedef CANSignal<0, 16, CAN_LITTLE_ENDIAN, true, 1, 10> SteeringAngle;  // degrees, left is negative
+  // TODO: Verify the scale for this value. The current scale is suspicious,
+  // but matches real-world testing so far. Need to go to a skid pad to
+  // verify for sure.
+  typedef CANSignal<16, 16, CAN_LITTLE_ENDIAN, true, -113, 355> RotationClockwise;  // degrees/s
+  // TODO: decode what's in payload[4] and payload[5].
+  // Looks to be encoded in a way that +1 increment is +0.2 m/s2.
+  typedef CANSignal<48, 8, CAN_LITTLE_ENDIAN, true, 1, 5> LateralAcceleration;  // m/s2
+  // Looks to be encoded in a way that +1 increment is -0.1 m/s2.
+  // I know, it's strange that they use different scales for lat vs long.
+  typedef CANSignal<56, 8, CAN_LITTLE_ENDIAN, true, -1, 10> LongitudinalAcceleration;  // m/s2
+};
+
+// 0xD1 contains the speed, and the master brake cylinder pressure.
+struct SpeedMessage : CANMessage<0xD1> {
+  // The encoding seems to be roughly radians per second x100.
+  // The coefficient was tuned by comparing the values against an external
+  // GPS from a session where I drove in a straight line on a highway at
+  // constant speed on cruise control.
+  typedef CANSignal<16, 16, CAN_LITTLE_ENDIAN, false, 25, 1593> Speed;  // m/s
+  // The units used for the master brake cylinder pressure are believed to
+  // be 1/128 kPa.
+  // TODO: This overlaps the speed; find where the pressure actually is.
+  typedef CANSignal<16, 8, CAN_LITTLE_ENDIAN, false, 128> BrakePressure;  // kPa
+};
+
+// Wheel speed sensors / ABS sensors.
+struct WheelSpeedMessage : CANMessage<0xD4> {
+  typedef CANSignal<0, 16> FrontLeft;
+  typedef CANSignal<16, 16> FrontRight;
+  typedef CANSignal<32, 16> RearLeft;
+  typedef CANSignal<48, 16> RearRight;
+};
+
+struct EngineMessage : CANMessage<0x140> {
+  typedef CANSignal<0, 8, CAN_LITTLE_ENDIAN, false, 100, 255> AcceleratorPedal;  // %
+  // The clutch pedal has two sensors:
+  // - 0% and >0% (used here)
+  // - 100% and <100% (haven't found yet)
+  // TODO: Find where data from the second sensor is.
+  typedef CANSignal<15, 1> ClutchDown;
+  // RPMs are believed to be encoded with just 14 bits.
+  typedef CANSignal<16, 14> Rpm;
+};
+
+struct TemperatureMessage : CANMessage<0x360> {
+  typedef CANSignal<16, 8, CAN_LITTLE_ENDIAN, false, 1, 1, -40> OilTemperature;  // ºC
+  typedef CANSignal<24, 8, CAN_LITTLE_ENDIAN, false, 1, 1, -40> CoolantTemperature;  // ºC
+};
+
 void generate_payload(uint16_t pid, uint8_t *payload) {
   memset(payload, /* value= */ 0, /* size= */ 8);
 
   switch (pid) {
-    case 0xD0: {
-      // 0xD0 contains the steering wheel angle and data from motion sensors.
-
+    case MotionMessage::MessageId: {
       // Pretend that the steering wheel is turned by 123 degrees to the left
-      int16_t steering_angle_degrees = -123;
-      int16_t value = steering_angle_degrees * 10;
-      payload[0] = value & 0xFF;
-      payload[1] = (value >> 8) & 0xFF;
-
-      // TODO: Verify the scale for this value. The current scale is suspicious,
-      // but matches real-world testing so far. Need to go to a skid pad to
-      // verify for sure.
-      int16_t rotation_clockwise_degrees_per_second = -70;
-      int16_t rotation_clockwise_radians_per_second_x180 =
-          (int16_t)(-3.14159 * rotation_clockwise_degrees_per_second);
-      payload[2] = rotation_clockwise_radians_per_second_x180 & 0xFF;
-      payload[3] = (rotation_clockwise_radians_per_second_x180 >> 8) & 0xFF;
-
-      // TODO: decode what's in payload[4] and payload[5].
+      MotionMessage::SteeringAngle::set(payload, -123);
+      MotionMessage::RotationClockwise::set(payload, -70);
 
       float lateral_acceleration_g = 0.3;
-      // Looks to be encoded in a way that +1 increment is +0.2 m/s2.
-      payload[6] = (int8_t)(9.80665 * lateral_acceleration_g / 0.2);
+      MotionMessage::LateralAcceleration::setFloat(payload, 9.80665 * lateral_acceleration_g);
 
       float longitudinal_acceleration_g = 0.2;
-      // Looks to be encoded in a way that +1 increment is -0.1 m/s2.
-      // I know, it's strange that they use different scales for lat vs long.
-      payload[7] = (int8_t)(-9.80665 * longitudinal_acceleration_g / 0.1);
+      MotionMessage::LongitudinalAcceleration::setFloat(payload, 9.80665 * longitudinal_acceleration_g);
       break;
     }
 
-    case 0xD1: {
-      // 0xD1 contains the speed, and the master brake cylinder pressure.
-      uint16_t speed_m_s = 10;  // 36 km/h, ~22.4 mph.
-      // The encoding seems to be roughly radians per second x100.
-      // The coefficient was tuned by comparing the values against an external
-      // GPS from a session where I drove in a straight line on a highway at
-      // constant speed on cruise control.
-      uint16_t speed_value = (uint16_t)(speed_m_s * 63.72);
-      payload[2] = speed_value & 0xFF;
-      payload[3] = (speed_value >> 8) & 0xFF;
-
-      // The units used for the master brake cylinder pressure are believed to
-      // be 1/128 kPa.
-      float brake_pressure_kPa = 1024;
-      payload[2] = (uint8_t)(brake_pressure_kPa / 128);
+    case SpeedMessage::MessageId: {
+      SpeedMessage::Speed::set(payload, 10);  // 36 km/h, ~22.4 mph.
+      SpeedMessage::BrakePressure::set(payload, 1024);
       break;
     }
 
-    case 0xD4: {
-      // Wheel speed sensors / ABS sensors.
-      uint16_t value = (uint16_t)(10 * 61);
-      payload[0] = value & 0xFF;
-      payload[1] = (value >> 8) & 0xFF;
-
-      value = (uint16_t)(10 * 62);
-      payload[2] = value & 0xFF;
-      payload[3] = (value >> 8) & 0xFF;
-
-      value = (uint16_t)(10 * 63);
-      payload[4] = value & 0xFF;
-      payload[5] = (value >> 8) & 0xFF;
-
-      value = (uint16_t)(10 * 64);
-      payload[6] = value & 0xFF;
-      payload[7] = (value >> 8) & 0xFF;
+    case WheelSpeedMessage::MessageId: {
+      WheelSpeedMessage::FrontLeft::set(payload, 10 * 61);
+      WheelSpeedMessage::FrontRight::set(payload, 10 * 62);
+      WheelSpeedMessage::RearLeft::set(payload, 10 * 63);
+      WheelSpeedMessage::RearRight::set(payload, 10 * 64);
       break;
     }
 
-    case 0x140: {
-      uint8_t accelerator_pedal_percent = 42;
-      payload[0] = accelerator_pedal_percent * 255 / 100;
-
-      // The clutch pedal has two sensors:
-      // - 0% and >0% (used here)
-      // - 100% and <100% (haven't found yet)
-      // TODO: Find where data from the second sensor is.
-      bool clutch_down = false;
-      payload[1] = (clutch_down ? 0x80 : 0x00);
-
-      // RPMs are believed to be encoded with just 14 bits.
-      uint16_t rpm = 3456;
-      payload[2] = rpm & 0xFF;
-      payload[3] = (rpm >> 8) & 0x3F;
+    case EngineMessage::MessageId: {
+      EngineMessage::AcceleratorPedal::set(payload, 42);
+      EngineMessage::ClutchDown::set(payload, false);
+      EngineMessage::Rpm::set(payload, 3456);
       break;
     }
 
-    case 0x360: {
-      uint8_t oil_temperature_celsius = 100;
-      payload[2] = oil_temperature_celsius + 40;
-
-      uint8_t coolant_temperature_celsius = 90;
-      payload[3] = coolant_temperature_celsius + 40;
+    case TemperatureMessage::MessageId: {
+      TemperatureMessage::OilTemperature::set(payload, 100);
+      TemperatureMessage::CoolantTemperature::set(payload, 90);
       break;
     }
   }
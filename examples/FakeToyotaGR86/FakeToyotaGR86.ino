@@ -1,4 +1,5 @@
 #include <CAN.h>
+#include <CANSignal.h>
 
 // This is a demo program that sends messages over the CAN bus in
 // a way that resembles real messages you can receive if you listen
@@ -251,72 +252,80 @@ void try_to_receive_data() {
   }
 }
 
+// Signals of the messages below, as decoded so far. See CANSignal.h for the
+// meaning of the template arguments (start bit, length, byte order, signed,
+// factor numerator / denominator, offset).
+
+struct EngineMessage : CANMessage<0x40> {
+  // The clutch pedal has two sensors:
+  // - 0% and >0% (used here)
+  // - 100% and <100% (haven't found yet)
+  // TODO: Find where data from the second sensor is.
+  typedef CANSignal<15, 1> ClutchDown;
+  // RPMs are believed to be encoded with just 14 bits.
+  typedef CANSignal<16, 14> Rpm;
+  // The accelerator pedal position is sent three times.
+  typedef CANSignal<32, 8, CAN_LITTLE_ENDIAN, false, 100, 255> AcceleratorPedal;  // %
+  typedef CANSignal<40, 8, CAN_LITTLE_ENDIAN, false, 100, 255> AcceleratorPedal2;  // %
+  typedef CANSignal<48, 8, CAN_LITTLE_ENDIAN, false, 100, 255> AcceleratorPedal3;  // %
+};
+
+struct MotionMessage : CANMessage<0x138> {
+  typedef CANSignal<16, 16, CAN_LITTLE_ENDIAN, true, 1, 10> SteeringAngle;  // degrees, left is negative
+  // TODO: Verify the scale for this value. The current scale is suspicious,
+  // but matches real-world testing so far. Need to go to a skid pad to
+  // verify for sure.
+  typedef CANSignal<32, 16, CAN_LITTLE_ENDIAN, true, -109, 400> YawRate;  // degrees/s
+};
+
+struct SpeedMessage : CANMessage<0x139> {
+  // The encoding seems to be roughly radians per second x100.
+  // The coefficient was tuned by comparing the values against an external
+  // GPS from a session where I drove in a straight line on a highway at
+  // constant speed on cruise control.
+  typedef CANSignal<16, 16, CAN_LITTLE_ENDIAN, false, 25, 1593> Speed;  // m/s
+  // TODO: Find out what this is.
+  typedef CANSignal<32, 8> Unknown4;
+  // The units used for the master brake cylinder pressure are believed to
+  // be 1/128 kPa.
+  typedef CANSignal<40, 8, CAN_LITTLE_ENDIAN, false, 128> BrakePressure;  // kPa
+};
+
+struct TemperatureMessage : CANMessage<0x345> {
+  typedef CANSignal<24, 8, CAN_LITTLE_ENDIAN, false, 1, 1, -40> OilTemperature;  // ºC
+  typedef CANSignal<32, 8, CAN_LITTLE_ENDIAN, false, 1, 1, -40> CoolantTemperature;  // ºC
+};
+
 void generate_payload(uint16_t pid, uint8_t *payload) {
   memset(payload, /* value= */ 0, /* size= */ 8);
 
   switch (pid) {
-    case 0x40: {
-      uint8_t accelerator_pedal_percent = 42;
-      payload[4] = accelerator_pedal_percent * 255 / 100;
-      payload[5] = payload[4];
-      payload[6] = payload[4];
-
-      // The clutch pedal has two sensors:
-      // - 0% and >0% (used here)
-      // - 100% and <100% (haven't found yet)
-      // TODO: Find where data from the second sensor is.
-      bool clutch_down = false;
-      payload[1] = (clutch_down ? 0x80 : 0x00);
-
-      // RPMs are believed to be encoded with just 14 bits.
-      uint16_t rpm = 3456;
-      payload[2] = rpm & 0xFF;
-      payload[3] = (rpm >> 8) & 0x3F;
+    case EngineMessage::MessageId: {
+      EngineMessage::AcceleratorPedal::set(payload, 42);
+      EngineMessage::AcceleratorPedal2::set(payload, 42);
+      EngineMessage::AcceleratorPedal3::set(payload, 42);
+      EngineMessage::ClutchDown::set(payload, false);
+      EngineMessage::Rpm::set(payload, 3456);
       break;
     }
 
-
-    case 0x138: {
+    case MotionMessage::MessageId: {
       // Pretend that the steering wheel is turned by 123 degrees to the left
-      int16_t steering_angle_degrees = -123;
-      int16_t steering_value = steering_angle_degrees * 10;
-      payload[2] = steering_value & 0xFF;
-      payload[3] = (steering_value >> 8) & 0xFF;
-
-      // TODO: Verify the scale for this value. The current scale is suspicious,
-      // but matches real-world testing so far. Need to go to a skid pad to
-      // verify for sure.
-      float yaw_rate_degrees_per_second = -12.3;
-      int16_t yaw_rate_value = (int16_t)(-yaw_rate_degrees_per_second / 0.2725);
-      payload[4] = yaw_rate_value & 0xFF;
-      payload[5] = (yaw_rate_value >> 8) & 0xFF;
+      MotionMessage::SteeringAngle::set(payload, -123);
+      MotionMessage::YawRate::setFloat(payload, -12.3);
       break;
     }
 
-    case 0x139: {
-      uint16_t speed_m_s = 10;  // 36 km/h, ~22.4 mph.
-      // The encoding seems to be roughly radians per second x100.
-      // The coefficient was tuned by comparing the values against an external
-      // GPS from a session where I drove in a straight line on a highway at
-      // constant speed on cruise control.
-      uint16_t speed_value = (uint16_t)(speed_m_s * 63.72);
-      payload[2] = speed_value & 0xFF;
-      payload[3] = (speed_value >> 8) & 0xFF;
-
-      // The units used for the master brake cylinder pressure are believed to
-      // be 1/128 kPa.
-      float brake_pressure_kPa = 1024;
-      payload[4] = 0x0C;
-      payload[5] = (uint8_t)(brake_pressure_kPa / 128);
+    case SpeedMessage::MessageId: {
+      SpeedMessage::Speed::set(payload, 10);  // 36 km/h, ~22.4 mph.
+      SpeedMessage::Unknown4::setRaw(payload, 0x0C);
+      SpeedMessage::BrakePressure::set(payload, 1024);
       break;
     }
 
-    case 0x345: {
-      uint8_t oil_temperature_celsius = 100;
-      payload[3] = oil_temperature_celsius + 40;
-
-      uint8_t coolant_temperature_celsius = 90;
-      payload[4] = coolant_temperature_celsius + 40;
+    case TemperatureMessage::MessageId: {
+      TemperatureMessage::OilTemperature::set(payload, 100);
+      TemperatureMessage::CoolantTemperature::set(payload, 90);
       break;
     }
   }
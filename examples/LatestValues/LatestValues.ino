@@ -0,0 +1,88 @@
+#include <CAN.h>
+#include <CANMailbox.h>
+#include <CANSignal.h>
+
+// This is a demo program that samples a few signals of a Subaru BRZ / Toyota
+// GR86 at 10 Hz, while the car sends them 50-100 times per second.
+//
+// Instead of reading every frame with parsePacket(), the driver keeps only the
+// newest frame of each ID in a mailbox, which loop() reads whenever it wants.
+//
+// Connections:
+//  MCP | BOARD
+//  INT | Pin 9
+//  SCK | SCK
+//   SI | MO
+//   SO | MI
+//   CS | Pin 7
+//  GND | GND
+//  VCC | 3.3V
+
+const int CS_PIN = 7;
+const int IRQ_PIN = 9;
+const int QUARTZ_MHZ = 16;  // Some MCP2515 boards have 8 MHz quartz.
+const int SPI_MHZ = 10;
+
+// The signals that are sampled, see CANSignal.h.
+struct EngineMessage : CANMessage<0x140> {
+  typedef CANSignal<16, 14> Rpm;
+};
+
+struct TemperatureMessage : CANMessage<0x360> {
+  typedef CANSignal<16, 8, CAN_LITTLE_ENDIAN, false, 1, 1, -40> OilTemperature;  // ºC
+  typedef CANSignal<24, 8, CAN_LITTLE_ENDIAN, false, 1, 1, -40> CoolantTemperature;  // ºC
+};
+
+CANMailboxSlot slots[3];
+CANMailbox mailbox(slots, 3);
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  CAN.setClockFrequency(QUARTZ_MHZ * 1E6);
+  CAN.setSPIFrequency(SPI_MHZ * 1E6);
+  CAN.setPins(CS_PIN, IRQ_PIN);
+
+  while (!CAN.begin(500000)) {
+    Serial.println("Failed to connect to the CAN controller!");
+    delay(1000);
+  }
+
+  mailbox.add(EngineMessage::MessageId);  // Accelerator pedal, RPMs.
+  mailbox.add(0x0D1);  // Speed.
+  mailbox.add(TemperatureMessage::MessageId);  // Oil and coolant temperatures.
+  CAN.setMailbox(&mailbox);
+
+  // Frames are stored from the interrupt; other IDs still reach this callback.
+  CAN.onReceive(onReceive);
+}
+
+void onReceive(int /*packetSize*/) {
+}
+
+uint16_t last_rpm_sequence = 0;
+
+void loop() {
+  CANFrame frame;
+  uint16_t sequence;
+
+  if (mailbox.read(EngineMessage::MessageId, frame, &sequence)) {
+    Serial.print("RPM: ");
+    Serial.print(EngineMessage::Rpm::get(frame));
+    Serial.print(" (");
+    Serial.print((uint16_t)(sequence - last_rpm_sequence));
+    Serial.println(" updates since the last sample)");
+    last_rpm_sequence = sequence;
+  }
+
+  if (mailbox.read(TemperatureMessage::MessageId, frame)) {
+    Serial.print("Oil: ");
+    Serial.print(TemperatureMessage::OilTemperature::get(frame));
+    Serial.print(" C, coolant: ");
+    Serial.print(TemperatureMessage::CoolantTemperature::get(frame));
+    Serial.println(" C");
+  }
+
+  delay(100);
+}
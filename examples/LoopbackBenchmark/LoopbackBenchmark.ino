@@ -0,0 +1,51 @@
+#include <CAN.h>
+#include <CANBenchmark.h>
+
+// This is a demo program that benchmarks the driver on a single board, with
+// the MCP2515 in loopback mode: no second board or CAN bus is needed, and
+// nothing is sent on the bus.
+//
+// For each SPI clock and payload size, it prints a CSV line with the time to
+// submit a frame, the TX-to-RX latency (min/avg/p99/max), the sustained
+// frames per second and the share of the time spent on SPI traffic.
+//
+// Connections:
+//  MCP | BOARD
+//  INT | Not used, can connect to Pin 9
+//  SCK | SCK
+//   SI | MO
+//   SO | MI
+//   CS | Pin 7
+//  GND | GND
+//  VCC | 3.3V
+
+const int CS_PIN = 7;
+const int IRQ_PIN = 9;
+const int QUARTZ_MHZ = 16;  // Some MCP2515 boards have 8 MHz quartz.
+const long BAUD_RATE = 1000 * 1E3;  // 1M baud rate.
+
+const uint32_t SPI_FREQUENCIES[] = { 1000000, 4000000, 8000000, 10000000 };
+const uint8_t PAYLOAD_SIZES[] = { 0, 4, 8 };
+
+CANBenchmark benchmark(CAN);
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  CAN.setClockFrequency(QUARTZ_MHZ * 1E6);
+  CAN.setPins(CS_PIN, IRQ_PIN);
+
+  while (!CAN.begin(BAUD_RATE)) {
+    Serial.println("Failed to connect to the CAN controller!");
+    delay(1000);
+  }
+
+  if (!benchmark.run(SPI_FREQUENCIES, sizeof(SPI_FREQUENCIES) / sizeof(SPI_FREQUENCIES[0]),
+          PAYLOAD_SIZES, sizeof(PAYLOAD_SIZES), Serial)) {
+    Serial.println("Failed to switch to loopback mode!");
+  }
+}
+
+void loop() {
+}
@@ -0,0 +1,104 @@
+#include <CAN.h>
+#include <CANDispatcher.h>
+#include <CANPoller.h>
+
+// This is a demo program that polls OBD-II PIDs at different rates, keeping a
+// request outstanding per ECU, and periodically prints the rate and latency
+// achieved for each PID.
+//
+// The intake and air temperatures are answered by the FakeSubaruBRZ example;
+// the other PIDs need a real ECU and are counted as timeouts otherwise.
+//
+// Connections:
+//  MCP | BOARD
+//  INT | Not used, can connect to Pin 9
+//  SCK | SCK
+//   SI | MO
+//   SO | MI
+//   CS | Pin 7
+//  GND | GND
+//  VCC | 3.3V
+
+const int CS_PIN = 7;
+const int IRQ_PIN = 9;
+const int QUARTZ_MHZ = 16;  // Some MCP2515 boards have 8 MHz quartz.
+const int SPI_MHZ = 8;
+
+// Interval in seconds between printing reports.
+const uint32_t REPORT_INTERVAL_SECONDS = 1;
+
+CANDispatchSlot dispatchSlots[4];
+CANDispatcher dispatcher(dispatchSlots, 4);
+CANPollSlot slots[4];
+CANPoller poller(CAN, slots, 4);
+
+uint16_t rpm = 0;
+uint32_t last_report_printed_ms;
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  CAN.setClockFrequency(QUARTZ_MHZ * 1E6);
+  CAN.setSPIFrequency(SPI_MHZ * 1E6);
+  CAN.setPins(CS_PIN, IRQ_PIN);
+
+  while (!CAN.begin(500000)) {
+    Serial.println("Failed to connect to the CAN controller!");
+    delay(1000);
+  }
+
+  CAN.setDispatcher(&dispatcher);
+
+  // Functional requests, answered by any ECU.
+  poller.add(CAN_POLL_FUNCTIONAL_ID, CAN_POLL_OBD_CURRENT_DATA, 0x0F, 100);  // Intake temperature.
+  poller.add(CAN_POLL_FUNCTIONAL_ID, CAN_POLL_OBD_CURRENT_DATA, 0x46, 1000);  // Air temperature.
+  // Physical requests to the transmission. As the functional requests reach
+  // it too, the two take turns; only requests to ECUs outside 0x7E0 to 0x7E7
+  // would be outstanding at the same time.
+  poller.add(0x7E1, CAN_POLL_OBD_CURRENT_DATA, 0x0C);  // Engine speed, as fast as possible.
+  poller.add(0x7E1, CAN_POLL_OBD_CURRENT_DATA, 0x0D, 200);  // Vehicle speed.
+  poller.onResponse(onResponse);
+  poller.begin();
+
+  last_report_printed_ms = millis();
+}
+
+void onResponse(uint8_t index, const uint8_t* data, uint8_t length, void* /*context*/) {
+  if (index == 2 && length >= 2) {
+    rpm = ((data[0] << 8) | data[1]) / 4;
+  }
+}
+
+void loop() {
+  // Runs the response handler; other frames are dropped.
+  while (CAN.parsePacket() || CAN.packetId() != -1);
+
+  poller.poll();
+
+  if (millis() - last_report_printed_ms < REPORT_INTERVAL_SECONDS * 1000) {
+    return;
+  }
+  last_report_printed_ms = millis();
+
+  for (uint8_t i = 0; i < poller.count(); i++) {
+    Serial.print(i);
+    Serial.print(": ");
+    Serial.print(poller.sampleRate(i));
+    Serial.print(" Hz, latency avg ");
+    Serial.print(poller.averageLatencyMicros(i));
+    Serial.print(" us, max ");
+    Serial.print(poller.maxLatencyMicros(i));
+    Serial.print(" us, timeouts ");
+    Serial.print(poller.timeouts(i));
+    Serial.print(", negative responses ");
+    Serial.println(poller.negativeResponses(i));
+  }
+  Serial.print("Total: ");
+  Serial.print(poller.totalSampleRate());
+  Serial.print(" Hz, engine speed ");
+  Serial.print(rpm);
+  Serial.println(" rpm");
+
+  poller.resetStatistics();
+}
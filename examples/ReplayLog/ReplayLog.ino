@@ -0,0 +1,74 @@
+#include <CAN.h>
+#include <CANReplay.h>
+
+// This is a demo program that replays a short recorded log onto the CAN bus,
+// reproducing the original timing, and reports how precisely it did so.
+//
+// Longer logs captured with CANLogger (see the CanBusLogger example) can be
+// replayed straight from an SD card File with replay.begin(file).
+//
+// DO NOT USE IT IN THE CAN NETWORK OF A REAL VEHICLE as it can cause unexpected
+// side effects.
+//
+// Connections:
+//  MCP | BOARD
+//  INT | Not used, can connect to Pin 9
+//  SCK | SCK
+//   SI | MO
+//   SO | MI
+//   CS | Pin 7
+//  GND | GND
+//  VCC | 3.3V
+
+const int CS_PIN = 7;
+const int IRQ_PIN = 9;
+const int QUARTZ_MHZ = 16;  // Some MCP2515 boards have 8 MHz quartz.
+const int SPI_MHZ = 10;
+
+// A 10 ms slice of a Subaru BRZ drive: 0x18 and 0x140-0x142 are sent every
+// 10 ms, the others every 20 ms.
+const CANReplayFrame LOG[] = {
+  {    0, { 0x018, false, false, 8, { 0x9A, 0x0E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } } },
+  {  250, { 0x140, false, false, 8, { 0x6B, 0x00, 0x80, 0x0D, 0x00, 0x00, 0x00, 0x00 } } },
+  {  250, { 0x141, false, false, 8, { 0x00, 0x00, 0x80, 0x0D, 0x00, 0x00, 0x00, 0x00 } } },
+  {  250, { 0x142, false, false, 8, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } } },
+  { 1300, { 0x0D0, false, false, 8, { 0x32, 0xFB, 0xDC, 0x00, 0x00, 0x00, 0x0E, 0xEC } } },
+  { 1550, { 0x0D1, false, false, 8, { 0x08, 0x00, 0x7D, 0x02, 0x00, 0x00, 0x00, 0x00 } } },
+  { 4800, { 0x0D4, false, false, 8, { 0x62, 0x02, 0x6C, 0x02, 0x76, 0x02, 0x80, 0x02 } } },
+  { 7200, { 0x360, false, false, 8, { 0x00, 0x00, 0x8C, 0x82, 0x00, 0x00, 0x00, 0x00 } } },
+};
+
+CANReplay replay(CAN);
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  CAN.setClockFrequency(QUARTZ_MHZ * 1E6);
+  CAN.setSPIFrequency(SPI_MHZ * 1E6);
+  CAN.setPins(CS_PIN, IRQ_PIN);
+
+  while (!CAN.begin(500000)) {
+    Serial.println("Failed to connect to the CAN controller!");
+    delay(1000);
+  }
+
+  Serial.println("CAN controller connected");
+}
+
+void loop() {
+  replay.begin(LOG, sizeof(LOG) / sizeof(LOG[0]));
+  while (replay.poll());
+
+  Serial.print("Sent ");
+  Serial.print(replay.framesSent());
+  Serial.print(" frames, timing error min/avg/max: ");
+  Serial.print(replay.minTimingError());
+  Serial.print("/");
+  Serial.print(replay.averageTimingError());
+  Serial.print("/");
+  Serial.print(replay.maxTimingError());
+  Serial.println(" us");
+
+  delay(1000);
+}
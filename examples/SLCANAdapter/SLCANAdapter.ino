@@ -0,0 +1,42 @@
+#include <CAN.h>
+#include <SLCAN.h>
+
+// This is a demo program that turns the board into an SLCAN (Lawicel) USB to
+// CAN adapter, usable with standard PC tools. On Linux:
+//
+//   sudo slcand -o -s6 -t hw -S 1000000 /dev/ttyACM0 can0
+//   sudo ip link set up can0
+//   candump can0
+//
+// SavvyCAN can use the serial port directly with its "LAWICEL" driver.
+//
+// Connections:
+//  MCP | BOARD
+//  INT | Not used, can connect to Pin 9
+//  SCK | SCK
+//   SI | MO
+//   SO | MI
+//   CS | Pin 7
+//  GND | GND
+//  VCC | 3.3V
+
+const int CS_PIN = 7;
+const int IRQ_PIN = 9;
+const int QUARTZ_MHZ = 16;  // Some MCP2515 boards have 8 MHz quartz.
+const int SPI_MHZ = 10;
+
+SLCANAdapter slcan(CAN, Serial);
+
+void setup() {
+  Serial.begin(1000000);
+
+  CAN.setClockFrequency(QUARTZ_MHZ * 1E6);
+  CAN.setSPIFrequency(SPI_MHZ * 1E6);
+  CAN.setPins(CS_PIN, IRQ_PIN);
+
+  // The CAN controller is started by the "O" command sent by the host.
+}
+
+void loop() {
+  slcan.poll();
+}
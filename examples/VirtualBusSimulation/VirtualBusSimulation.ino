@@ -0,0 +1,117 @@
+#include <VirtualCAN.h>
+
+// This is a demo program that simulates a small vehicle network without any
+// CAN hardware: a few ECUs sending cyclic frames at their usual rates, and a
+// gateway receiving all of them, on a virtual 500 kbps bus.
+//
+// The simulation runs much faster than real time. Once done, it prints the
+// bus load, the latency distribution and the per-node counters.
+
+const long BAUD_RATE = 500000;
+const unsigned long SIMULATED_MICROS = 10000000;  // 10 seconds.
+
+struct CyclicFrame {
+  long id;
+  unsigned long periodMicros;
+  unsigned long nextMicros;
+};
+
+const int ECU_COUNT = 4;
+
+VirtualCANBus bus;
+VirtualCANClass ecus[ECU_COUNT] = {
+  VirtualCANClass(bus), VirtualCANClass(bus), VirtualCANClass(bus), VirtualCANClass(bus)
+};
+VirtualCANClass gateway(bus);
+
+// Two cyclic frames per ECU, e.g. engine, brakes, steering and body.
+CyclicFrame schedule[ECU_COUNT][2] = {
+  { { 0x0D0, 10000, 0 }, { 0x140, 10000, 0 } },
+  { { 0x0D1, 20000, 0 }, { 0x0D4, 20000, 0 } },
+  { { 0x141, 20000, 0 }, { 0x144, 50000, 0 } },
+  { { 0x360, 50000, 0 }, { 0x361, 100000, 0 } },
+};
+
+unsigned long gatewayFrames = 0;
+
+void onGatewayReceive(int /*packetSize*/) {
+  gatewayFrames++;
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  bus.begin(BAUD_RATE);
+  for (int i = 0; i < ECU_COUNT; i++) {
+    ecus[i].begin(BAUD_RATE);
+  }
+  gateway.begin(BAUD_RATE);
+  gateway.setBufferLimits(8, 3);
+  gateway.onReceive(onGatewayReceive);
+
+  // Corrupt 1 frame in 10000, reproducibly.
+  bus.setErrorRate(100);
+
+  unsigned long start = millis();
+
+  while (bus.micros() < SIMULATED_MICROS) {
+    unsigned long now = bus.micros();
+
+    for (int i = 0; i < ECU_COUNT; i++) {
+      for (int j = 0; j < 2; j++) {
+        CyclicFrame& frame = schedule[i][j];
+        if ((long)(now - frame.nextMicros) >= 0) {
+          ecus[i].beginPacket(frame.id);
+          ecus[i].write((const uint8_t*)&now, sizeof(now));
+          ecus[i].endPacket();
+          frame.nextMicros += frame.periodMicros;
+        }
+      }
+    }
+
+    bus.run(1000);
+  }
+
+  Serial.print("Simulated ");
+  Serial.print(SIMULATED_MICROS / 1000);
+  Serial.print(" ms in ");
+  Serial.print(millis() - start);
+  Serial.println(" ms");
+
+  Serial.print("Frames: ");
+  Serial.print(bus.framesSent());
+  Serial.print(", error frames: ");
+  Serial.print(bus.errorFrames());
+  Serial.print(", bus load: ");
+  Serial.print(bus.busLoad() * 100);
+  Serial.println(" %");
+
+  Serial.print("Latency (us): min ");
+  Serial.print(bus.minLatency());
+  Serial.print(", avg ");
+  Serial.print(bus.averageLatency());
+  Serial.print(", p99 ");
+  Serial.print(bus.latencyPercentile(99));
+  Serial.print(", max ");
+  Serial.println(bus.maxLatency());
+
+  for (int i = 0; i < ECU_COUNT; i++) {
+    Serial.print("ECU ");
+    Serial.print(i);
+    Serial.print(": sent ");
+    Serial.print(ecus[i].framesSent());
+    Serial.print(", lost arbitration ");
+    Serial.print(ecus[i].arbitrationLosses());
+    Serial.print(", TEC ");
+    Serial.println(ecus[i].transmitErrorCount());
+  }
+
+  Serial.print("Gateway: received ");
+  Serial.print(gatewayFrames);
+  Serial.print(", overflows ");
+  Serial.println(gateway.rxOverflows());
+}
+
+void loop() {
+}
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+# Copyright (c) Sandeep Mistry. All rights reserved.
+# Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+"""Decodes a capture written by CANLogger into candump log or CSV format.
+
+Usage:
+  canlog_decode.py capture.bin                 # candump -l style output
+  canlog_decode.py --format csv capture.bin    # CSV output
+  cat /dev/ttyACM0 | canlog_decode.py -        # decode a live serial stream
+
+See src/CANLogger.h for a description of the format.
+"""
+
+import argparse
+import sys
+
+TAG_DLC_MASK = 0x0F
+TAG_RTR = 0x10
+TAG_EXTENDED = 0x20
+TAG_SAME_ID = 0x40
+TAG_SYNC = 0x80
+TAG_DROPPED = 0xFF
+
+MAGIC = b"CANL"
+VERSION = 1
+
+
+class Reader:
+    def __init__(self, stream):
+        self.stream = stream
+
+    def byte(self):
+        b = self.stream.read(1)
+        if not b:
+            raise EOFError
+        return b[0]
+
+    def bytes(self, n):
+        b = self.stream.read(n)
+        if len(b) != n:
+            raise EOFError
+        return b
+
+    def varint(self):
+        value = 0
+        shift = 0
+        while True:
+            b = self.byte()
+            value |= (b & 0x7F) << shift
+            if not b & 0x80:
+                return value
+            shift += 7
+
+
+def decode(stream):
+    """Yields (timestamp_us, id, extended, rtr, dlc, data) and ('dropped', n)."""
+    reader = Reader(stream)
+    header = reader.bytes(5)
+    if header[:4] != MAGIC:
+        raise ValueError("not a CANLogger capture")
+    if header[4] != VERSION:
+        raise ValueError("unsupported capture version %d" % header[4])
+
+    # Device timestamps are 32-bit micros() and wrap every ~71 minutes, so
+    # they are accumulated into an unbounded host-side timestamp.
+    timestamp = None
+    last_id = None
+    try:
+        while True:
+            tag = reader.byte()
+            if tag == TAG_DROPPED:
+                yield ("dropped", reader.varint())
+                continue
+
+            dlc = tag & TAG_DLC_MASK
+            if tag & TAG_SYNC:
+                absolute = int.from_bytes(reader.bytes(4), "little")
+                if timestamp is None:
+                    timestamp = absolute
+                else:
+                    timestamp += (absolute - timestamp) & 0xFFFFFFFF
+                if not tag & TAG_SAME_ID:
+                    last_id = reader.varint()
+            else:
+                if timestamp is None:
+                    raise ValueError("delta record before the first sync record")
+                timestamp += reader.varint()
+                if not tag & TAG_SAME_ID:
+                    zigzag = reader.varint()
+                    last_id += (zigzag >> 1) ^ -(zigzag & 1)
+
+            rtr = bool(tag & TAG_RTR)
+            data = b"" if rtr else reader.bytes(dlc)
+            yield (timestamp, last_id, bool(tag & TAG_EXTENDED), rtr, dlc, data)
+    except EOFError:
+        return
+
+
+def format_candump(frame, interface):
+    timestamp, can_id, extended, rtr, dlc, data = frame
+    ident = ("%08X" if extended else "%03X") % can_id
+    payload = ("R%d" % dlc) if rtr else data.hex().upper()
+    return "(%d.%06d) %s %s#%s" % (timestamp // 1000000, timestamp % 1000000,
+                                   interface, ident, payload)
+
+
+def format_csv(frame):
+    timestamp, can_id, extended, rtr, dlc, data = frame
+    return "%d,0x%X,%d,%d,%d,%s" % (timestamp, can_id, int(extended),
+                                    int(rtr), dlc, data.hex().upper())
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="capture file, or - for stdin")
+    parser.add_argument("--format", choices=("candump", "csv"), default="candump")
+    parser.add_argument("--interface", default="can0",
+                        help="interface name used in candump output")
+    args = parser.parse_args()
+
+    stream = sys.stdin.buffer if args.input == "-" else open(args.input, "rb")
+    out = sys.stdout
+
+    if args.format == "csv":
+        out.write("timestamp_us,id,extended,rtr,dlc,data\n")
+
+    dropped = 0
+    for frame in decode(stream):
+        if frame[0] == "dropped":
+            dropped += frame[1]
+            continue
+        if args.format == "csv":
+            out.write(format_csv(frame) + "\n")
+        else:
+            out.write(format_candump(frame, args.interface) + "\n")
+
+    if dropped:
+        sys.stderr.write("%d frames were dropped on the device\n" % dropped)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,233 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CANBenchmark.h"
+
+#define BENCHMARK_ID               0x123
+
+// A frame that has not looped back by then is counted as lost.
+#define LATENCY_TIMEOUT_MICROS     20000
+
+CANBenchmark::CANBenchmark(MCP2515Class& can) :
+  _can(&can),
+  _durationMillis(1000),
+  _sequence(0)
+{
+}
+
+int CANBenchmark::run(uint32_t spiFrequency, uint8_t payloadSize, CANBenchmarkResult& result)
+{
+  if (payloadSize > 8) {
+    return 0;
+  }
+
+  memset(&result, 0x00, sizeof(result));
+  result.spiFrequency = spiFrequency;
+  result.payloadSize = payloadSize;
+
+  _can->setSPIFrequency(spiFrequency);
+  if (!_can->loopback()) {
+    return 0;
+  }
+
+  measureLatency(payloadSize, result);
+  measureThroughput(payloadSize, result);
+
+  return _can->switchToNormalMode() ? 1 : 0;
+}
+
+int CANBenchmark::run(const uint32_t* spiFrequencies, uint8_t spiFrequencyCount,
+    const uint8_t* payloadSizes, uint8_t payloadSizeCount, Print& out)
+{
+  int ok = 1;
+
+  printHeader(out);
+  for (uint8_t i = 0; i < spiFrequencyCount; i++) {
+    for (uint8_t j = 0; j < payloadSizeCount; j++) {
+      CANBenchmarkResult result;
+      if (run(spiFrequencies[i], payloadSizes[j], result)) {
+        printResult(result, out);
+      } else {
+        ok = 0;
+      }
+    }
+  }
+
+  return ok;
+}
+
+void CANBenchmark::printHeader(Print& out)
+{
+  out.println("spi_hz,payload,frames,lost,submit_min_us,submit_avg_us,submit_max_us,"
+      "latency_min_us,latency_avg_us,latency_p99_us,latency_max_us,"
+      "frames_per_s,rx_overflows,spi_share_pct");
+}
+
+void CANBenchmark::printResult(const CANBenchmarkResult& result, Print& out)
+{
+  const unsigned long values[] = {
+    (unsigned long)result.spiFrequency,
+    result.payloadSize,
+    result.frames,
+    result.framesLost,
+    result.minSubmit,
+    result.averageSubmit,
+    result.maxSubmit,
+    result.minLatency,
+    result.averageLatency,
+    result.p99Latency,
+    result.maxLatency,
+    result.framesPerSecond,
+    result.rxOverflows,
+    result.spiShare,
+  };
+
+  for (unsigned int i = 0; i < (sizeof(values) / sizeof(values[0])); i++) {
+    if (i > 0) {
+      out.print(',');
+    }
+    out.print(values[i]);
+  }
+  out.println();
+}
+
+void CANBenchmark::measureLatency(uint8_t payloadSize, CANBenchmarkResult& result)
+{
+  // Frames left over from an earlier run.
+  while (receive());
+
+  unsigned long sumSubmit = 0;
+  unsigned long sumLatency = 0;
+  result.minSubmit = 0xffffffff;
+  result.minLatency = 0xffffffff;
+
+  for (uint16_t i = 0; i < CAN_BENCHMARK_SAMPLES; i++) {
+    unsigned long start = micros();
+    int queued = submit(payloadSize, CAN_TX_NO_WAIT);
+    unsigned long submit = micros() - start;
+
+    bool received = false;
+    if (queued == CAN_TX_PENDING) {
+      while (micros() - start < LATENCY_TIMEOUT_MICROS) {
+        if (receive()) {
+          received = true;
+          break;
+        }
+      }
+    }
+    unsigned long latency = micros() - start;
+
+    // Releases the TX buffer.
+    _can->pollTransmit();
+
+    if (!received) {
+      result.framesLost++;
+      continue;
+    }
+
+    if (submit < result.minSubmit) {
+      result.minSubmit = submit;
+    }
+    if (submit > result.maxSubmit) {
+      result.maxSubmit = submit;
+    }
+    sumSubmit += submit;
+
+    if (latency < result.minLatency) {
+      result.minLatency = latency;
+    }
+    if (latency > result.maxLatency) {
+      result.maxLatency = latency;
+    }
+    sumLatency += latency;
+
+    _samples[result.frames++] = latency > 0xffff ? 0xffff : latency;
+  }
+
+  if (result.frames == 0) {
+    result.minSubmit = 0;
+    result.minLatency = 0;
+    return;
+  }
+
+  result.averageSubmit = sumSubmit / result.frames;
+  result.averageLatency = sumLatency / result.frames;
+
+  // Insertion sort: the samples are few, and mostly in order already.
+  for (uint16_t i = 1; i < result.frames; i++) {
+    uint16_t sample = _samples[i];
+    uint16_t j = i;
+    while (j > 0 && _samples[j - 1] > sample) {
+      _samples[j] = _samples[j - 1];
+      j--;
+    }
+    _samples[j] = sample;
+  }
+  result.p99Latency = _samples[((unsigned long)result.frames * 99 + 99) / 100 - 1];
+}
+
+void CANBenchmark::measureThroughput(uint8_t payloadSize, CANBenchmarkResult& result)
+{
+  unsigned long rxOverflows = _can->rxOverflows();
+  unsigned long received = 0;
+  unsigned long busy = 0;
+  unsigned long duration = _durationMillis * 1000;
+
+  // Only calls that moved a frame count as busy; polling an idle controller
+  // is time the CAN bus kept the driver waiting.
+  unsigned long start = micros();
+  while (micros() - start < duration) {
+    unsigned long t = micros();
+    if (_can->pollTransmit() > 0) {
+      busy += micros() - t;
+    }
+
+    t = micros();
+    if (submit(payloadSize, CAN_TX_NO_WAIT) == CAN_TX_PENDING) {
+      busy += micros() - t;
+    }
+
+    t = micros();
+    while (receive()) {
+      received++;
+      unsigned long now = micros();
+      busy += now - t;
+      t = now;
+    }
+  }
+  unsigned long elapsed = micros() - start;
+
+  // Lets the frames still in flight complete, so that the next run starts
+  // with free TX buffers.
+  delay(10);
+  while (receive());
+  _can->pollTransmit();
+
+  // Picks up the overflow flags.
+  _can->pollErrors();
+
+  result.framesPerSecond = (uint64_t)received * 1000000 / elapsed;
+  result.rxOverflows = _can->rxOverflows() - rxOverflows;
+  result.spiShare = (uint64_t)busy * 100 / elapsed;
+}
+
+int CANBenchmark::submit(uint8_t payloadSize, uint8_t flags)
+{
+  if (!_can->beginPacket(BENCHMARK_ID, payloadSize)) {
+    return 0;
+  }
+
+  for (uint8_t i = 0; i < payloadSize; i++) {
+    _can->write(_sequence++);
+  }
+
+  return _can->endPacket(0, flags);
+}
+
+bool CANBenchmark::receive()
+{
+  // parsePacket() returns the DLC, which is 0 for empty payloads.
+  _can->parsePacket();
+
+  return _can->packetId() == BENCHMARK_ID;
+}
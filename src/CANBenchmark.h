@@ -0,0 +1,89 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_BENCHMARK_H
+#define CAN_BENCHMARK_H
+
+#include <Arduino.h>
+
+#include "MCP2515.h"
+
+// Number of latency samples per run, from which the 99th percentile is taken.
+// Fixed per architecture, as it sizes the sample buffer of CANBenchmark.
+#ifdef ARDUINO_ARCH_AVR
+#define CAN_BENCHMARK_SAMPLES 64
+#else
+#define CAN_BENCHMARK_SAMPLES 256
+#endif
+
+// The results of one run; times are in microseconds.
+struct CANBenchmarkResult {
+  uint32_t spiFrequency;
+  uint8_t payloadSize;
+
+  // Latency phase: one frame at a time.
+  uint16_t frames;
+  uint16_t framesLost;
+  unsigned long minSubmit;
+  unsigned long averageSubmit;
+  unsigned long maxSubmit;
+  unsigned long minLatency;
+  unsigned long averageLatency;
+  unsigned long p99Latency;
+  unsigned long maxLatency;
+
+  // Throughput phase: all TX buffers kept busy.
+  unsigned long framesPerSecond;
+  unsigned long rxOverflows;
+  // Share of the time spent in driver calls that moved a frame, i.e. SPI
+  // traffic. Close to 100 means the SPI link, not the CAN bus, is the limit.
+  uint8_t spiShare;
+};
+
+// Measures the driver on a single board, with the MCP2515 in loopback mode:
+//
+// - submit: time taken by beginPacket()/write()/endPacket() to queue a frame
+// - latency: time from the start of submit until parsePacket() returns the
+//   frame, which includes the transmission at the configured baud rate
+// - frames per second: sustained rate with all TX buffers kept busy
+//
+// for each combination of the given SPI clocks and payload sizes. Results are
+// printed as CSV, one line per run:
+//
+//   CANBenchmark benchmark(CAN);
+//   benchmark.run(spiFrequencies, 3, payloadSizes, 3, Serial);
+//
+// CAN.begin() must have been called. No onReceive() callback, mailbox,
+// change filter or dispatcher may be attached, as they would take the frames.
+// The controller is switched back to normal mode afterwards, but is left at
+// the last SPI clock.
+class CANBenchmark {
+
+public:
+  explicit CANBenchmark(MCP2515Class& can);
+
+  // Length of the throughput phase of each run. Defaults to 1000 ms.
+  void setDuration(unsigned long durationMillis) { _durationMillis = durationMillis; }
+
+  int run(uint32_t spiFrequency, uint8_t payloadSize, CANBenchmarkResult& result);
+  int run(const uint32_t* spiFrequencies, uint8_t spiFrequencyCount,
+      const uint8_t* payloadSizes, uint8_t payloadSizeCount, Print& out);
+
+  static void printHeader(Print& out);
+  static void printResult(const CANBenchmarkResult& result, Print& out);
+
+private:
+  void measureLatency(uint8_t payloadSize, CANBenchmarkResult& result);
+  void measureThroughput(uint8_t payloadSize, CANBenchmarkResult& result);
+  int submit(uint8_t payloadSize, uint8_t flags);
+  bool receive();
+
+private:
+  MCP2515Class* _can;
+  unsigned long _durationMillis;
+  uint8_t _sequence;
+
+  uint16_t _samples[CAN_BENCHMARK_SAMPLES];
+};
+
+#endif
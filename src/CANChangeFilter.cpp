@@ -0,0 +1,128 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CANChangeFilter.h"
+
+#define KEY_USED                   0x80000000UL
+#define KEY_EXTENDED               0x40000000UL
+
+CANChangeFilter::CANChangeFilter(CANChangeFilterSlot* slots, uint16_t capacity) :
+  _slots(slots),
+  _capacity(capacity),
+  _heartbeatMillis(0),
+  _framesSeen(0),
+  _framesSuppressed(0)
+{
+  clear();
+}
+
+int CANChangeFilter::setIgnoredBytes(long id, uint8_t byteMask)
+{
+  CANChangeFilterSlot* s = findOrInsert(key(id & 0x7ff, false));
+  if (s == NULL) {
+    return 0;
+  }
+
+  s->ignoredBytes = byteMask;
+  s->delivered = false;
+
+  return 1;
+}
+
+int CANChangeFilter::setIgnoredBytesExtended(long id, uint8_t byteMask)
+{
+  CANChangeFilterSlot* s = findOrInsert(key(id & 0x1fffffff, true));
+  if (s == NULL) {
+    return 0;
+  }
+
+  s->ignoredBytes = byteMask;
+  s->delivered = false;
+
+  return 1;
+}
+
+void CANChangeFilter::clear()
+{
+  for (uint16_t i = 0; i < _capacity; i++) {
+    _slots[i].key = 0;
+  }
+}
+
+bool CANChangeFilter::changed(const CANFrame& frame, unsigned long nowMillis)
+{
+  _framesSeen++;
+
+  CANChangeFilterSlot* s = findOrInsert(key(frame.id, frame.extended));
+  if (s == NULL) {
+    // Out of slots; deliver rather than lose data.
+    return true;
+  }
+
+  uint32_t h = hash(frame, s->ignoredBytes);
+  if (s->delivered && s->hash == h &&
+      (_heartbeatMillis == 0 || nowMillis - s->lastDeliveredMillis < _heartbeatMillis)) {
+    _framesSuppressed++;
+    return false;
+  }
+
+  s->hash = h;
+  s->lastDeliveredMillis = nowMillis;
+  s->delivered = true;
+
+  return true;
+}
+
+CANChangeFilterSlot* CANChangeFilter::findOrInsert(uint32_t key)
+{
+  if (_capacity == 0) {
+    return NULL;
+  }
+
+  // Open addressing with linear probing. Slots are never removed, so an
+  // empty slot ends the search.
+  uint16_t start = (key * 2654435761UL >> 16) % _capacity;
+  for (uint16_t n = 0; n < _capacity; n++) {
+    uint16_t i = start + n;
+    if (i >= _capacity) {
+      i -= _capacity;
+    }
+
+    CANChangeFilterSlot& s = _slots[i];
+    if (s.key == key) {
+      return &s;
+    }
+
+    if (s.key == 0) {
+      s.key = key;
+      s.hash = 0;
+      s.lastDeliveredMillis = 0;
+      s.ignoredBytes = 0;
+      s.delivered = false;
+      return &s;
+    }
+  }
+
+  return NULL;
+}
+
+uint32_t CANChangeFilter::key(long id, bool extended)
+{
+  return (uint32_t)id | KEY_USED | (extended ? KEY_EXTENDED : 0);
+}
+
+uint32_t CANChangeFilter::hash(const CANFrame& frame, uint8_t ignoredBytes)
+{
+  // FNV-1a over the DLC, the RTR bit and the compared data bytes.
+  uint32_t h = 2166136261UL;
+  h = (h ^ (frame.dlc | (frame.rtr ? 0x80 : 0x00))) * 16777619UL;
+
+  if (!frame.rtr) {
+    for (uint8_t i = 0; i < frame.dlc && i < 8; i++) {
+      uint8_t b = (ignoredBytes & (1 << i)) ? 0x00 : frame.data[i];
+      h = (h ^ b) * 16777619UL;
+    }
+  }
+
+  return h;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_CHANGE_FILTER_H
+#define CAN_CHANGE_FILTER_H
+
+#include <Arduino.h>
+
+#include "CANController.h"
+
+// State kept per CAN ID. Treat as opaque.
+struct CANChangeFilterSlot {
+  uint32_t key;
+  uint32_t hash;
+  unsigned long lastDeliveredMillis;
+  uint8_t ignoredBytes;
+  bool delivered;
+};
+
+// Suppresses frames whose payload is identical to the last delivered frame
+// of the same ID, which is the case for most cyclic frames on vehicle buses.
+//
+// IDs are learned as they appear, up to the number of slots passed to the
+// constructor; frames of IDs that do not fit are always delivered. Payloads
+// are compared through a 32-bit hash, so that each ID costs 14 bytes of RAM on
+// AVR.
+//
+//   CANChangeFilterSlot slots[64];
+//   CANChangeFilter changes(slots, 64);
+//
+//   changes.setHeartbeat(1000);            // still deliver every second
+//   changes.setIgnoredBytes(0x140, 0x80);  // byte 7 is a rolling counter
+//   CAN.setChangeFilter(&changes);
+class CANChangeFilter {
+
+public:
+  CANChangeFilter(CANChangeFilterSlot* slots, uint16_t capacity);
+
+  // Delivers unchanged frames anyway once `intervalMillis` have passed since
+  // the last delivery of the ID. 0 (the default) disables the heartbeat.
+  void setHeartbeat(unsigned long intervalMillis) { _heartbeatMillis = intervalMillis; }
+
+  // Excludes bytes from the comparison, e.g. counters and checksums. Bit n of
+  // `byteMask` stands for data byte n. Returns 0 if there is no free slot.
+  int setIgnoredBytes(long id, uint8_t byteMask);
+  int setIgnoredBytesExtended(long id, uint8_t byteMask);
+
+  // Forgets all IDs, including their ignored bytes.
+  void clear();
+
+  // Returns whether `frame` differs from the last delivered frame of its ID,
+  // and if so, records it as delivered.
+  bool changed(const CANFrame& frame, unsigned long nowMillis);
+
+  unsigned long framesSeen() const { return _framesSeen; }
+  unsigned long framesSuppressed() const { return _framesSuppressed; }
+
+private:
+  CANChangeFilterSlot* findOrInsert(uint32_t key);
+
+  static uint32_t key(long id, bool extended);
+  static uint32_t hash(const CANFrame& frame, uint8_t ignoredBytes);
+
+private:
+  CANChangeFilterSlot* _slots;
+  uint16_t _capacity;
+  unsigned long _heartbeatMillis;
+
+  unsigned long _framesSeen;
+  unsigned long _framesSuppressed;
+};
+
+#endif
@@ -2,9 +2,15 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
 #include "CANController.h"
+#include "CANChangeFilter.h"
+#include "CANDispatcher.h"
+#include "CANMailbox.h"
 
 CANControllerClass::CANControllerClass() :
   _onReceive(NULL),
+  _mailbox(NULL),
+  _changeFilter(NULL),
+  _dispatcher(NULL),
 
   _packetBegun(false),
   _txId(-1),
@@ -107,6 +113,23 @@ int CANControllerClass::endPacket()
   return 1;
 }
 
+int CANControllerClass::sendFrame(const CANFrame& frame)
+{
+  int dlc = frame.rtr ? frame.dlc : -1;
+  int began = frame.extended
+      ? beginExtendedPacket(frame.id, dlc, frame.rtr)
+      : beginPacket(frame.id, dlc, frame.rtr);
+  if (!began) {
+    return 0;
+  }
+
+  if (!frame.rtr) {
+    write(frame.data, frame.dlc > 8 ? 8 : frame.dlc);
+  }
+
+  return endPacket();
+}
+
 int CANControllerClass::parsePacket()
 {
   return 0;
@@ -132,6 +155,16 @@ int CANControllerClass::packetDlc()
   return _rxDlc;
 }
 
+void CANControllerClass::packetFrame(CANFrame& frame)
+{
+  frame.id = _rxId;
+  frame.extended = _rxExtended;
+  frame.rtr = _rxRtr;
+  frame.dlc = _rxDlc;
+  memset(frame.data, 0x00, sizeof(frame.data));
+  memcpy(frame.data, _rxData, _rxLength);
+}
+
 size_t CANControllerClass::write(uint8_t byte)
 {
   return write(&byte, sizeof(byte));
@@ -185,6 +218,67 @@ void CANControllerClass::onReceive(void(*callback)(int))
   _onReceive = callback;
 }
 
+void CANControllerClass::setMailbox(CANMailbox* mailbox)
+{
+  _mailbox = mailbox;
+}
+
+void CANControllerClass::setChangeFilter(CANChangeFilter* changeFilter)
+{
+  _changeFilter = changeFilter;
+}
+
+void CANControllerClass::setDispatcher(CANDispatcher* dispatcher)
+{
+  _dispatcher = dispatcher;
+}
+
+int CANControllerClass::onReceive(int id, CANFrameHandler handler, void* context)
+{
+  return _dispatcher ? _dispatcher->onReceive(id, handler, context) : 0;
+}
+
+int CANControllerClass::onReceive(int id, int mask, CANFrameHandler handler, void* context)
+{
+  return _dispatcher ? _dispatcher->onReceive(id, mask, handler, context) : 0;
+}
+
+int CANControllerClass::onReceiveExtended(long id, CANFrameHandler handler, void* context)
+{
+  return _dispatcher ? _dispatcher->onReceiveExtended(id, handler, context) : 0;
+}
+
+int CANControllerClass::onReceiveExtended(long id, long mask, CANFrameHandler handler, void* context)
+{
+  return _dispatcher ? _dispatcher->onReceiveExtended(id, mask, handler, context) : 0;
+}
+
+bool CANControllerClass::deliverPacket()
+{
+  if (!_mailbox && !_changeFilter && !_dispatcher) {
+    return true;
+  }
+
+  CANFrame frame;
+  packetFrame(frame);
+
+  if (_mailbox && _mailbox->store(frame, micros()) && !_mailbox->passThrough()) {
+    return false;
+  }
+
+  // The mailbox always holds the latest frame; unchanged frames are only
+  // kept from the handlers and the user.
+  if (_changeFilter && !_changeFilter->changed(frame, millis())) {
+    return false;
+  }
+
+  if (_dispatcher && _dispatcher->dispatch(frame)) {
+    return false;
+  }
+
+  return true;
+}
+
 int CANControllerClass::filter(int /*id*/, int /*mask*/)
 {
   return 0;
@@ -214,3 +308,13 @@ int CANControllerClass::wakeup()
 {
   return 0;
 }
+
+int CANControllerClass::errorState() const
+{
+  return CAN_ERROR_ACTIVE;
+}
+
+unsigned long CANControllerClass::rxOverflows() const
+{
+  return 0;
+}
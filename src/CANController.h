@@ -6,6 +6,28 @@
 
 #include <Arduino.h>
 
+// Error states, as defined by the CAN specification.
+#define CAN_ERROR_ACTIVE           0
+#define CAN_ERROR_WARNING          1
+#define CAN_ERROR_PASSIVE          2
+#define CAN_BUS_OFF                3
+
+// A complete CAN frame, used by the components that need to store or pass
+// around frames rather than stream them through beginPacket()/parsePacket().
+struct CANFrame {
+  long id;
+  bool extended;
+  bool rtr;
+  uint8_t dlc;
+  uint8_t data[8];
+};
+
+typedef void (*CANFrameHandler)(const CANFrame& frame, void* context);
+
+class CANChangeFilter;
+class CANDispatcher;
+class CANMailbox;
+
 class CANControllerClass : public Stream {
 
 public:
@@ -15,12 +37,16 @@ public:
   int beginPacket(int id, int dlc = -1, bool rtr = false);
   int beginExtendedPacket(long id, int dlc = -1, bool rtr = false);
   virtual int endPacket();
+  // Sends a complete frame, equivalent to beginPacket()/write()/endPacket().
+  int sendFrame(const CANFrame& frame);
 
   virtual int parsePacket();
   long packetId();
   bool packetExtended();
   bool packetRtr();
   int packetDlc();
+  // Copies the last received packet into `frame`, without consuming it.
+  void packetFrame(CANFrame& frame);
 
   // from Print
   virtual size_t write(uint8_t byte);
@@ -34,6 +60,24 @@ public:
 
   virtual void onReceive(void(*callback)(int));
 
+  // Per-ID handlers, see CANDispatcher. They need a dispatcher attached with
+  // setDispatcher(), and run from parsePacket(): either call it from loop(),
+  // or register an onReceive() callback so that it runs from the interrupt.
+  // Frames that have a handler are not returned by parsePacket().
+  void setDispatcher(CANDispatcher* dispatcher);
+  int onReceive(int id, CANFrameHandler handler, void* context = NULL);
+  int onReceive(int id, int mask, CANFrameHandler handler, void* context = NULL);
+  int onReceiveExtended(long id, CANFrameHandler handler, void* context = NULL);
+  int onReceiveExtended(long id, long mask, CANFrameHandler handler, void* context = NULL);
+
+  // Stores frames with registered IDs in `mailbox` instead of queueing them
+  // for parsePacket(). Pass NULL to detach.
+  void setMailbox(CANMailbox* mailbox);
+
+  // Only reports frames whose payload changed, see CANChangeFilter. Pass NULL
+  // to detach.
+  void setChangeFilter(CANChangeFilter* changeFilter);
+
   virtual int filter(int id) { return filter(id, 0x7ff); }
   virtual int filter(int id, int mask);
   virtual int filterExtended(long id) { return filterExtended(id, 0x1fffffff); }
@@ -44,12 +88,26 @@ public:
   virtual int sleep();
   virtual int wakeup();
 
+  // Error state (CAN_ERROR_ACTIVE to CAN_BUS_OFF) and frames lost because
+  // the RX buffers were full, for controllers that track them. The defaults
+  // report a healthy controller.
+  virtual int errorState() const;
+  virtual unsigned long rxOverflows() const;
+
 protected:
   CANControllerClass();
   virtual ~CANControllerClass();
 
+protected:
+  // Runs the receive hooks on the packet just read into _rx*. Returns false
+  // if the packet was consumed and must not be reported to the user.
+  bool deliverPacket();
+
 protected:
   void (*_onReceive)(int);
+  CANMailbox* _mailbox;
+  CANChangeFilter* _changeFilter;
+  CANDispatcher* _dispatcher;
 
   bool _packetBegun;
   long _txId;
@@ -0,0 +1,185 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CANDispatcher.h"
+
+CANDispatcher::CANDispatcher(CANDispatchSlot* slots, uint8_t capacity, uint8_t* standardIds) :
+  _slots(slots),
+  _capacity(capacity),
+  _standardIds(standardIds)
+{
+  // The number of chains is a power of two, for a mask instead of a modulo.
+  uint8_t chains = 1;
+  while (chains <= capacity / 2) {
+    chains *= 2;
+  }
+  _chainMask = capacity ? chains - 1 : 0;
+
+  clear();
+}
+
+int CANDispatcher::onReceive(int id, CANFrameHandler handler, void* context)
+{
+  return onReceive(id, 0x7ff, handler, context);
+}
+
+int CANDispatcher::onReceive(int id, int mask, CANFrameHandler handler, void* context)
+{
+  if (id < 0 || id > 0x7FF) {
+    return 0;
+  }
+
+  return add(id, mask & 0x7ff, false, handler, context);
+}
+
+int CANDispatcher::onReceiveExtended(long id, CANFrameHandler handler, void* context)
+{
+  return onReceiveExtended(id, 0x1fffffff, handler, context);
+}
+
+int CANDispatcher::onReceiveExtended(long id, long mask, CANFrameHandler handler, void* context)
+{
+  if (id < 0 || id > 0x1FFFFFFF) {
+    return 0;
+  }
+
+  return add(id, mask & 0x1fffffff, true, handler, context);
+}
+
+void CANDispatcher::onReceiveOther(CANFrameHandler handler, void* context)
+{
+  _otherHandler = handler;
+  _otherContext = context;
+}
+
+void CANDispatcher::clear()
+{
+  _count = 0;
+  _maskedHead = 0;
+  _maskedTail = 0;
+  if (_capacity) {
+    for (uint16_t i = 0; i <= _chainMask; i++) {
+      _slots[i].chain = 0;
+    }
+  }
+  if (_standardIds) {
+    memset(_standardIds, 0x00, CAN_DISPATCH_STANDARD_IDS);
+  }
+  _otherHandler = NULL;
+  _otherContext = NULL;
+}
+
+bool CANDispatcher::dispatch(const CANFrame& frame)
+{
+  const CANDispatchSlot* entry = lookup(frame.id, frame.extended);
+  if (entry) {
+    entry->handler(frame, entry->context);
+    return true;
+  }
+
+  if (_otherHandler) {
+    _otherHandler(frame, _otherContext);
+    return true;
+  }
+
+  return false;
+}
+
+int CANDispatcher::add(uint32_t id, uint32_t mask, bool extended, CANFrameHandler handler, void* context)
+{
+  if (handler == NULL) {
+    return 0;
+  }
+
+  id &= mask;
+
+  for (uint8_t i = 0; i < _count; i++) {
+    CANDispatchSlot& entry = _slots[i];
+    if (entry.id == id && entry.mask == mask && entry.extended == extended) {
+      entry.handler = handler;
+      entry.context = context;
+      return 1;
+    }
+  }
+
+  if (_count >= _capacity) {
+    return 0;
+  }
+
+  uint8_t index = _count;
+  CANDispatchSlot& entry = _slots[index];
+  entry.id = id;
+  entry.mask = mask;
+  entry.extended = extended;
+  entry.handler = handler;
+  entry.context = context;
+  entry.next = 0;
+
+  bool exact = mask == (extended ? 0x1fffffffUL : 0x7ffUL);
+
+  if (!extended && _standardIds) {
+    if (exact) {
+      _standardIds[id] = index + 1;
+    } else {
+      // Expand the mask into the index, leaving IDs that already have a
+      // handler alone: exact IDs and earlier masks win.
+      for (uint16_t i = 0; i < CAN_DISPATCH_STANDARD_IDS; i++) {
+        if ((i & mask) == id && _standardIds[i] == 0) {
+          _standardIds[i] = index + 1;
+        }
+      }
+    }
+  } else if (exact) {
+    uint8_t& chain = _slots[hash(id, extended)].chain;
+    entry.next = chain;
+    chain = index + 1;
+  } else {
+    // Appended, so that earlier masks win.
+    if (_maskedTail) {
+      _slots[_maskedTail - 1].next = index + 1;
+    } else {
+      _maskedHead = index + 1;
+    }
+    _maskedTail = index + 1;
+  }
+  _count++;
+
+  return 1;
+}
+
+const CANDispatchSlot* CANDispatcher::lookup(uint32_t id, bool extended) const
+{
+  if (!extended && _standardIds) {
+    uint8_t slot = _standardIds[id & 0x7ff];
+    return slot ? &_slots[slot - 1] : NULL;
+  }
+
+  if (_count == 0) {
+    return NULL;
+  }
+
+  // Chains are about one registration long on average, as there are at least
+  // half as many as slots.
+  for (uint8_t slot = _slots[hash(id, extended)].chain; slot; slot = _slots[slot - 1].next) {
+    const CANDispatchSlot& entry = _slots[slot - 1];
+    if (entry.id == id && entry.extended == extended) {
+      return &entry;
+    }
+  }
+
+  for (uint8_t slot = _maskedHead; slot; slot = _slots[slot - 1].next) {
+    const CANDispatchSlot& entry = _slots[slot - 1];
+    if (entry.extended == extended && (id & entry.mask) == entry.id) {
+      return &entry;
+    }
+  }
+
+  return NULL;
+}
+
+uint8_t CANDispatcher::hash(uint32_t id, bool extended) const
+{
+  // Fibonacci hashing; the top bits of the product are the best mixed.
+  uint32_t h = (id ^ (extended ? 0x20000000UL : 0)) * 2654435761UL;
+  return (h >> 16) & _chainMask;
+}
@@ -0,0 +1,89 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_DISPATCHER_H
+#define CAN_DISPATCHER_H
+
+#include <Arduino.h>
+
+#include "CANController.h"
+
+// Entries of the optional direct index of 11-bit IDs, see CANDispatcher.
+#define CAN_DISPATCH_STANDARD_IDS  0x800
+
+typedef void (*CANFrameHandler)(const CANFrame& frame, void* context);
+
+// Storage for one handler registration. Treat as opaque.
+struct CANDispatchSlot {
+  uint32_t id;
+  uint32_t mask;
+  bool extended;
+  CANFrameHandler handler;
+  void* context;
+  // Slot index + 1 of the next registration in the same hash chain, or in
+  // the list of masked registrations; 0 ends the list.
+  uint8_t next;
+  // Slot index + 1 of the first registration in the hash chain with the
+  // number of this slot.
+  uint8_t chain;
+};
+
+// Routes received frames to per-ID handlers in constant time, regardless of
+// the number of registered IDs:
+//
+//   CANDispatchSlot slots[64];
+//   CANDispatcher dispatcher(slots, 64);
+//   CAN.setDispatcher(&dispatcher);
+//   CAN.onReceive(0x7DF, handleObdRequest, &ecu);
+//
+// IDs are hashed into as many chains as there are slots, rounded down to a
+// power of two. Where 2 KB of RAM can be spared, 11-bit IDs are looked up in
+// a table indexed by the ID itself instead:
+//
+//   uint8_t standardIds[CAN_DISPATCH_STANDARD_IDS];
+//   CANDispatcher dispatcher(slots, 64, standardIds);
+//
+// Exact IDs take precedence over masked registrations. Masked standard IDs
+// are expanded into the direct index at registration time, so they are O(1)
+// as well; masked extended IDs (and masked standard IDs without the direct
+// index) are checked one by one after a miss.
+class CANDispatcher {
+
+public:
+  // Up to 255 slots.
+  CANDispatcher(CANDispatchSlot* slots, uint8_t capacity, uint8_t* standardIds = NULL);
+
+  // Handles frames for which (frameId & mask) == (id & mask). Registering an
+  // ID and mask again replaces its handler. Returns 0 if all slots are used.
+  int onReceive(int id, CANFrameHandler handler, void* context = NULL);
+  int onReceive(int id, int mask, CANFrameHandler handler, void* context = NULL);
+  int onReceiveExtended(long id, CANFrameHandler handler, void* context = NULL);
+  int onReceiveExtended(long id, long mask, CANFrameHandler handler, void* context = NULL);
+  // Handles all frames without a matching registration.
+  void onReceiveOther(CANFrameHandler handler, void* context = NULL);
+  void clear();
+
+  // Calls the handler of `frame`. Returns false if there is none.
+  bool dispatch(const CANFrame& frame);
+
+private:
+  int add(uint32_t id, uint32_t mask, bool extended, CANFrameHandler handler, void* context);
+  const CANDispatchSlot* lookup(uint32_t id, bool extended) const;
+  uint8_t hash(uint32_t id, bool extended) const;
+
+private:
+  CANDispatchSlot* _slots;
+  uint8_t _capacity;
+  uint8_t _count;
+  uint8_t _chainMask;
+
+  // Slot index + 1; 0 marks an ID without handler.
+  uint8_t* _standardIds;
+  uint8_t _maskedHead;
+  uint8_t _maskedTail;
+
+  CANFrameHandler _otherHandler;
+  void* _otherContext;
+};
+
+#endif
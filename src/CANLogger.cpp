@@ -0,0 +1,374 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CANLogger.h"
+#include "CANSPIBus.h"
+
+// Tag + 4-byte timestamp or 5-byte varint + 5-byte varint ID + payload.
+#define MAX_RECORD_SIZE            (1 + 5 + 5 + 8)
+// Tag + 5-byte varint count.
+#define MAX_DROP_RECORD_SIZE       (1 + 5)
+
+CANLogger::CANLogger(uint8_t* buffers, uint16_t bufferSize) :
+  _sink(NULL),
+  _spiBus(NULL),
+  _buffers(buffers),
+  _bufferSize(bufferSize),
+  _active(0),
+  _lastId(-1),
+  _lastTimestamp(0),
+  _recordsSinceSync(0),
+  _unreportedDrops(0),
+  _framesLogged(0),
+  _framesDropped(0),
+  _bytesWritten(0)
+{
+  _length[0] = _length[1] = 0;
+  _pending[0] = _pending[1] = false;
+}
+
+void CANLogger::begin(Print& sink)
+{
+  noInterrupts();
+  _sink = &sink;
+  _active = 0;
+  _length[0] = _length[1] = 0;
+  _pending[0] = _pending[1] = false;
+  _lastId = -1;
+  _lastTimestamp = 0;
+  _recordsSinceSync = 0;
+  _unreportedDrops = 0;
+  _framesLogged = 0;
+  _framesDropped = 0;
+  _bytesWritten = 0;
+  interrupts();
+
+  const uint8_t header[] = { 'C', 'A', 'N', 'L', CAN_LOGGER_VERSION };
+  _bytesWritten += writeSink(header, sizeof(header));
+}
+
+void CANLogger::end()
+{
+  flush();
+  _sink = NULL;
+}
+
+int CANLogger::log(const CANFrame& frame, unsigned long timestampMicros)
+{
+  if (_sink == NULL) {
+    return 0;
+  }
+
+  uint8_t drop[MAX_DROP_RECORD_SIZE];
+  size_t dropSize = 0;
+  if (_unreportedDrops) {
+    drop[0] = CAN_LOGGER_TAG_DROPPED;
+    dropSize = 1 + putVarint(&drop[1], _unreportedDrops);
+  }
+
+  uint8_t record[MAX_RECORD_SIZE];
+  size_t recordSize = encode(frame, timestampMicros, record);
+
+  if (!reserve(dropSize + recordSize)) {
+    _unreportedDrops++;
+    _framesDropped++;
+    return 0;
+  }
+
+  if (dropSize) {
+    append(drop, dropSize);
+    _unreportedDrops = 0;
+  }
+  append(record, recordSize);
+
+  // Only commit the delta state once the record is actually in the buffer,
+  // the decoder never sees dropped frames.
+  if (record[0] & CAN_LOGGER_TAG_SYNC) {
+    _recordsSinceSync = 0;
+  } else {
+    _recordsSinceSync++;
+  }
+  _lastId = frame.id;
+  _lastTimestamp = timestampMicros;
+  _framesLogged++;
+
+  return 1;
+}
+
+int CANLogger::logPacket(CANControllerClass& can)
+{
+  CANFrame frame;
+  can.packetFrame(frame);
+
+  return log(frame, micros());
+}
+
+void CANLogger::poll()
+{
+  if (_sink == NULL) {
+    return;
+  }
+
+  // The buffer that is not active is only ever touched here once it is
+  // pending, so it can be written out with interrupts enabled.
+  for (uint8_t n = 0; n < 2; n++) {
+    if (!_pending[n]) {
+      continue;
+    }
+
+    _bytesWritten += writeSink(&_buffers[n * _bufferSize], _length[n]);
+
+    noInterrupts();
+    _length[n] = 0;
+    _pending[n] = false;
+    interrupts();
+  }
+}
+
+void CANLogger::flush()
+{
+  if (_sink == NULL) {
+    return;
+  }
+
+  poll();
+
+  noInterrupts();
+  if (_unreportedDrops) {
+    uint8_t drop[MAX_DROP_RECORD_SIZE];
+    drop[0] = CAN_LOGGER_TAG_DROPPED;
+    size_t dropSize = 1 + putVarint(&drop[1], _unreportedDrops);
+    if (reserve(dropSize)) {
+      append(drop, dropSize);
+      _unreportedDrops = 0;
+    }
+  }
+
+  uint8_t n = _active;
+  if (_length[n] > 0) {
+    _pending[n] = true;
+    _active = n ^ 1;
+  }
+  interrupts();
+
+  poll();
+
+  if (_spiBus) {
+    _spiBus->lock();
+  }
+  _sink->flush();
+  if (_spiBus) {
+    _spiBus->unlock();
+  }
+}
+
+size_t CANLogger::writeSink(const uint8_t* data, size_t size)
+{
+  if (_spiBus) {
+    _spiBus->lock();
+  }
+  size_t written = _sink->write(data, size);
+  if (_spiBus) {
+    _spiBus->unlock();
+  }
+
+  return written;
+}
+
+size_t CANLogger::encode(const CANFrame& frame, unsigned long timestampMicros, uint8_t* out)
+{
+  uint8_t dlc = frame.dlc & CAN_LOGGER_TAG_DLC_MASK;
+  if (dlc > 8) {
+    dlc = 8;
+  }
+
+  uint8_t tag = dlc;
+  if (frame.rtr) {
+    tag |= CAN_LOGGER_TAG_RTR;
+  }
+  if (frame.extended) {
+    tag |= CAN_LOGGER_TAG_EXTENDED;
+  }
+
+  size_t size = 1;
+  if (_lastId < 0 || _recordsSinceSync >= CAN_LOGGER_SYNC_INTERVAL) {
+    tag |= CAN_LOGGER_TAG_SYNC;
+    out[size++] = timestampMicros & 0xff;
+    out[size++] = (timestampMicros >> 8) & 0xff;
+    out[size++] = (timestampMicros >> 16) & 0xff;
+    out[size++] = (timestampMicros >> 24) & 0xff;
+    size += putVarint(&out[size], (uint32_t)frame.id);
+  } else {
+    size += putVarint(&out[size], (uint32_t)(timestampMicros - _lastTimestamp));
+    if (frame.id == _lastId) {
+      tag |= CAN_LOGGER_TAG_SAME_ID;
+    } else {
+      int32_t delta = (int32_t)(frame.id - _lastId);
+      // Zigzag encoding keeps small negative deltas small.
+      size += putVarint(&out[size], ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    }
+  }
+  out[0] = tag;
+
+  if (!frame.rtr) {
+    memcpy(&out[size], frame.data, dlc);
+    size += dlc;
+  }
+
+  return size;
+}
+
+bool CANLogger::reserve(size_t size)
+{
+  uint8_t n = _active;
+  if (_length[n] + size <= _bufferSize) {
+    return true;
+  }
+
+  // The active buffer is full; hand it over to poll() and switch to the other
+  // one, unless that one has not been written out yet.
+  if (_pending[n ^ 1]) {
+    return false;
+  }
+
+  _pending[n] = true;
+  _active = n ^ 1;
+
+  return size <= _bufferSize;
+}
+
+void CANLogger::append(const uint8_t* data, size_t size)
+{
+  uint8_t n = _active;
+  memcpy(&_buffers[n * _bufferSize + _length[n]], data, size);
+  _length[n] += size;
+}
+
+size_t CANLogger::putVarint(uint8_t* out, uint32_t value)
+{
+  size_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[size++] = value;
+
+  return size;
+}
+
+CANLogReader::CANLogReader() :
+  _in(NULL),
+  _lastId(-1),
+  _lastTimestamp(0),
+  _framesDropped(0)
+{
+}
+
+int CANLogReader::begin(Stream& in)
+{
+  _in = NULL;
+  _lastId = -1;
+  _lastTimestamp = 0;
+  _framesDropped = 0;
+
+  const uint8_t header[] = { 'C', 'A', 'N', 'L', CAN_LOGGER_VERSION };
+  for (size_t i = 0; i < sizeof(header); i++) {
+    if (in.read() != header[i]) {
+      return 0;
+    }
+  }
+
+  _in = &in;
+
+  return 1;
+}
+
+int CANLogReader::read(CANFrame& frame, unsigned long& timestampMicros)
+{
+  if (_in == NULL) {
+    return 0;
+  }
+
+  int tag;
+  while ((tag = _in->read()) == CAN_LOGGER_TAG_DROPPED) {
+    uint32_t count;
+    if (!readVarint(count)) {
+      return 0;
+    }
+    _framesDropped += count;
+  }
+
+  if (tag < 0) {
+    return 0;
+  }
+
+  if (tag & CAN_LOGGER_TAG_SYNC) {
+    uint32_t timestamp = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+      int b = _in->read();
+      if (b < 0) {
+        return 0;
+      }
+      timestamp |= (uint32_t)b << (8 * i);
+    }
+    _lastTimestamp = timestamp;
+  } else {
+    uint32_t delta;
+    if (_lastId < 0 || !readVarint(delta)) {
+      return 0;
+    }
+    _lastTimestamp += delta;
+  }
+
+  if (!(tag & CAN_LOGGER_TAG_SAME_ID)) {
+    uint32_t value;
+    if (!readVarint(value)) {
+      return 0;
+    }
+    if (tag & CAN_LOGGER_TAG_SYNC) {
+      _lastId = value;
+    } else {
+      _lastId += (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+    }
+  }
+
+  frame.id = _lastId;
+  frame.extended = (tag & CAN_LOGGER_TAG_EXTENDED) ? true : false;
+  frame.rtr = (tag & CAN_LOGGER_TAG_RTR) ? true : false;
+  frame.dlc = tag & CAN_LOGGER_TAG_DLC_MASK;
+  if (frame.dlc > 8) {
+    return 0;
+  }
+
+  memset(frame.data, 0x00, sizeof(frame.data));
+  if (!frame.rtr) {
+    for (uint8_t i = 0; i < frame.dlc; i++) {
+      int b = _in->read();
+      if (b < 0) {
+        return 0;
+      }
+      frame.data[i] = b;
+    }
+  }
+
+  timestampMicros = _lastTimestamp;
+
+  return 1;
+}
+
+bool CANLogReader::readVarint(uint32_t& value)
+{
+  value = 0;
+  for (uint8_t shift = 0; shift < 35; shift += 7) {
+    int b = _in->read();
+    if (b < 0) {
+      return false;
+    }
+    value |= (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+
+  return false;
+}
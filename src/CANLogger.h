@@ -0,0 +1,144 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_LOGGER_H
+#define CAN_LOGGER_H
+
+#include <Arduino.h>
+
+#include "CANController.h"
+
+class CANSPIBus;
+
+// Suggested size of each of the two capture buffers. Larger buffers absorb
+// longer stalls of the sink (e.g. SD card block erases) at the cost of RAM.
+#define CAN_LOGGER_BUFFER_SIZE     256
+
+// An absolute (sync) record is emitted every this many records, so that a
+// decoder can recover from a corrupted or truncated capture.
+#ifndef CAN_LOGGER_SYNC_INTERVAL
+#define CAN_LOGGER_SYNC_INTERVAL 64
+#endif
+
+#define CAN_LOGGER_VERSION         1
+
+// Binary capture format.
+//
+// The stream starts with the 4-byte magic "CANL" and a version byte, followed
+// by records. Each record starts with a tag byte:
+//
+//   bits 0-3  DLC
+//   bit 4     RTR
+//   bit 5     extended ID
+//   bit 6     same ID as the previous record, no ID field follows
+//   bit 7     sync record
+//
+// A sync record continues with the absolute timestamp (uint32, little endian,
+// microseconds) and the absolute ID (varint). Other records continue with the
+// timestamp delta to the previous record (varint) and, unless bit 6 is set,
+// the ID delta to the previous record (zigzag varint). The payload (DLC bytes)
+// follows unless the frame is an RTR.
+//
+// The tag 0xFF marks dropped frames and is followed by the drop count (varint).
+//
+// Varints are little endian base-128, 7 bits per byte, MSB set on all bytes
+// but the last. See extras/canlog_decode.py for a host-side decoder.
+#define CAN_LOGGER_TAG_DLC_MASK    0x0f
+#define CAN_LOGGER_TAG_RTR         0x10
+#define CAN_LOGGER_TAG_EXTENDED    0x20
+#define CAN_LOGGER_TAG_SAME_ID     0x40
+#define CAN_LOGGER_TAG_SYNC        0x80
+#define CAN_LOGGER_TAG_DROPPED     0xff
+
+class CANLogger {
+
+public:
+  // `buffers` holds the two capture buffers of `bufferSize` bytes each, i.e.
+  // 2 * bufferSize bytes. Each buffer must fit a record, at least 19 bytes.
+  //
+  //   uint8_t logBuffers[2 * CAN_LOGGER_BUFFER_SIZE];
+  //   CANLogger logger(logBuffers, CAN_LOGGER_BUFFER_SIZE);
+  CANLogger(uint8_t* buffers, uint16_t bufferSize);
+
+  // Starts a new capture into `sink`, writing the stream header.
+  void begin(Print& sink);
+  void end();
+
+  // Locks `bus` around every access to the sink, for sinks that share the
+  // SPI bus with the MCP2515 (e.g. an SD card). See CANSPIBus.
+  void setSPIBus(CANSPIBus* bus) { _spiBus = bus; }
+
+  // Appends a frame to the capture. Safe to call from the onReceive()
+  // callback; never blocks and never allocates. Returns 0 if the frame was
+  // dropped because both buffers are waiting to be written out.
+  int log(const CANFrame& frame, unsigned long timestampMicros);
+  // Logs the packet last returned by can.parsePacket(), timestamped now.
+  int logPacket(CANControllerClass& can);
+
+  // Writes any completed buffer out to the sink. Call from loop().
+  void poll();
+  // Writes everything captured so far, including a partially filled buffer.
+  void flush();
+
+  unsigned long framesLogged() const { return _framesLogged; }
+  unsigned long framesDropped() const { return _framesDropped; }
+  unsigned long bytesWritten() const { return _bytesWritten; }
+
+private:
+  size_t encode(const CANFrame& frame, unsigned long timestampMicros, uint8_t* out);
+  bool reserve(size_t size);
+  void append(const uint8_t* data, size_t size);
+  size_t writeSink(const uint8_t* data, size_t size);
+
+  static size_t putVarint(uint8_t* out, uint32_t value);
+
+private:
+  Print* _sink;
+  CANSPIBus* _spiBus;
+
+  uint8_t* _buffers;
+  uint16_t _bufferSize;
+  volatile uint16_t _length[2];
+  volatile bool _pending[2];
+  volatile uint8_t _active;
+
+  long _lastId;
+  unsigned long _lastTimestamp;
+  uint16_t _recordsSinceSync;
+  unsigned long _unreportedDrops;
+
+  unsigned long _framesLogged;
+  unsigned long _framesDropped;
+  unsigned long _bytesWritten;
+};
+
+// Reads frames back from a capture written by CANLogger, e.g. from an SD
+// card File. The whole of each record must be readable from the stream;
+// running out of data is treated as the end of the capture.
+class CANLogReader {
+
+public:
+  CANLogReader();
+
+  // Reads and checks the stream header. Returns 0 if `in` is not a capture.
+  int begin(Stream& in);
+
+  // Reads the next frame. Returns 0 at the end of the capture or on a
+  // malformed record.
+  int read(CANFrame& frame, unsigned long& timestampMicros);
+
+  // Number of frames the logger reported as dropped so far.
+  unsigned long framesDropped() const { return _framesDropped; }
+
+private:
+  bool readVarint(uint32_t& value);
+
+private:
+  Stream* _in;
+
+  long _lastId;
+  unsigned long _lastTimestamp;
+  unsigned long _framesDropped;
+};
+
+#endif
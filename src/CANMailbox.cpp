@@ -0,0 +1,164 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CANMailbox.h"
+
+#define KEY_EXTENDED               0x80000000UL
+
+// Keeps the compiler from moving memory accesses across the sequence checks.
+#define COMPILER_BARRIER()         __asm__ __volatile__("" ::: "memory")
+
+CANMailbox::CANMailbox(CANMailboxSlot* slots, uint8_t capacity) :
+  _slots(slots),
+  _capacity(capacity),
+  _count(0),
+  _passThrough(false)
+{
+}
+
+int CANMailbox::add(long id)
+{
+  if (id < 0 || id > 0x7FF) {
+    return 0;
+  }
+
+  return insert(key(id, false));
+}
+
+int CANMailbox::addExtended(long id)
+{
+  if (id < 0 || id > 0x1FFFFFFF) {
+    return 0;
+  }
+
+  return insert(key(id, true));
+}
+
+void CANMailbox::clear()
+{
+  _count = 0;
+}
+
+int CANMailbox::read(long id, CANFrame& frame, uint16_t* sequence, unsigned long* timestampMicros)
+{
+  return readKey(key(id, false), frame, sequence, timestampMicros);
+}
+
+int CANMailbox::readExtended(long id, CANFrame& frame, uint16_t* sequence, unsigned long* timestampMicros)
+{
+  return readKey(key(id, true), frame, sequence, timestampMicros);
+}
+
+bool CANMailbox::store(const CANFrame& frame, unsigned long timestampMicros)
+{
+  CANMailboxSlot* slot = find(key(frame.id, frame.extended));
+  if (slot == NULL) {
+    return false;
+  }
+
+  // The sequence is odd while the slot is being written, so that readers
+  // interrupted by the update know to retry.
+  slot->sequence++;
+  COMPILER_BARRIER();
+  slot->timestampMicros = timestampMicros;
+  slot->valid = true;
+  slot->rtr = frame.rtr;
+  slot->dlc = frame.dlc;
+  memcpy(slot->data, frame.data, sizeof(slot->data));
+  COMPILER_BARRIER();
+  slot->sequence++;
+
+  return true;
+}
+
+int CANMailbox::insert(uint32_t key)
+{
+  if (_count >= _capacity || find(key) != NULL) {
+    return 0;
+  }
+
+  // Slots are kept sorted by key for a binary search on receive.
+  uint8_t i = _count;
+  while (i > 0 && _slots[i - 1].key > key) {
+    _slots[i] = _slots[i - 1];
+    i--;
+  }
+
+  CANMailboxSlot& slot = _slots[i];
+  slot.key = key;
+  slot.sequence = 0;
+  slot.valid = false;
+  slot.timestampMicros = 0;
+  slot.rtr = false;
+  slot.dlc = 0;
+  memset(slot.data, 0x00, sizeof(slot.data));
+  _count++;
+
+  return 1;
+}
+
+int CANMailbox::readKey(uint32_t key, CANFrame& frame, uint16_t* sequence, unsigned long* timestampMicros)
+{
+  CANMailboxSlot* slot = find(key);
+  if (slot == NULL) {
+    return 0;
+  }
+
+  uint16_t before;
+  uint16_t after;
+  unsigned long timestamp;
+  bool valid;
+  do {
+    before = slot->sequence;
+    COMPILER_BARRIER();
+    valid = slot->valid;
+    timestamp = slot->timestampMicros;
+    frame.rtr = slot->rtr;
+    frame.dlc = slot->dlc;
+    memcpy(frame.data, slot->data, sizeof(frame.data));
+    COMPILER_BARRIER();
+    after = slot->sequence;
+  } while ((before & 1) || before != after);
+
+  // The sequence wraps around, so it cannot tell an empty slot.
+  if (!valid) {
+    return 0;
+  }
+
+  frame.id = key & ~KEY_EXTENDED;
+  frame.extended = (key & KEY_EXTENDED) ? true : false;
+
+  if (sequence) {
+    *sequence = before >> 1;
+  }
+  if (timestampMicros) {
+    *timestampMicros = timestamp;
+  }
+
+  return 1;
+}
+
+CANMailboxSlot* CANMailbox::find(uint32_t key)
+{
+  uint8_t low = 0;
+  uint8_t high = _count;
+  while (low < high) {
+    uint8_t mid = (low + high) / 2;
+    if (_slots[mid].key < key) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (low < _count && _slots[low].key == key) {
+    return &_slots[low];
+  }
+
+  return NULL;
+}
+
+uint32_t CANMailbox::key(long id, bool extended)
+{
+  return (uint32_t)id | (extended ? KEY_EXTENDED : 0);
+}
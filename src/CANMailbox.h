@@ -0,0 +1,77 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_MAILBOX_H
+#define CAN_MAILBOX_H
+
+#include <Arduino.h>
+
+#include "CANController.h"
+
+// Storage for the latest frame of one CAN ID. Treat as opaque; use the
+// CANMailbox accessors.
+struct CANMailboxSlot {
+  uint32_t key;
+  volatile uint16_t sequence;
+  bool valid;
+  unsigned long timestampMicros;
+  bool rtr;
+  uint8_t dlc;
+  uint8_t data[8];
+};
+
+// Keeps only the newest frame of each registered CAN ID, for consumers that
+// sample signals at their own pace rather than process every frame.
+//
+// The receive path overwrites the slot of the frame's ID; readers copy the
+// latest frame at any time without blocking. Memory is bounded by the slots
+// array passed to the constructor, regardless of the traffic rate.
+//
+//   CANMailboxSlot slots[8];
+//   CANMailbox mailbox(slots, 8);
+//
+//   mailbox.add(0x140);
+//   CAN.setMailbox(&mailbox);
+//   ...
+//   CANFrame frame;
+//   if (mailbox.read(0x140, frame)) { ... }
+class CANMailbox {
+
+public:
+  CANMailbox(CANMailboxSlot* slots, uint8_t capacity);
+
+  // Registers an ID. Register all IDs before attaching the mailbox with
+  // setMailbox(). Returns 0 if the mailbox is full or the ID already exists.
+  int add(long id);
+  int addExtended(long id);
+  void clear();
+
+  // Copies the newest frame of the ID into `frame`. Returns 0 if the ID is not
+  // registered or no frame has been received yet. `sequence` is incremented
+  // on each update, so readers can tell whether the frame is new.
+  int read(long id, CANFrame& frame, uint16_t* sequence = NULL, unsigned long* timestampMicros = NULL);
+  int readExtended(long id, CANFrame& frame, uint16_t* sequence = NULL, unsigned long* timestampMicros = NULL);
+
+  // Stores a frame if its ID is registered; called by the receive path.
+  bool store(const CANFrame& frame, unsigned long timestampMicros);
+
+  // By default, stored frames are not passed on to parsePacket() and the
+  // onReceive() callback. Enable to receive them there as well.
+  void setPassThrough(bool passThrough) { _passThrough = passThrough; }
+  bool passThrough() const { return _passThrough; }
+
+private:
+  int insert(uint32_t key);
+  int readKey(uint32_t key, CANFrame& frame, uint16_t* sequence, unsigned long* timestampMicros);
+  CANMailboxSlot* find(uint32_t key);
+
+  static uint32_t key(long id, bool extended);
+
+private:
+  CANMailboxSlot* _slots;
+  uint8_t _capacity;
+  uint8_t _count;
+  bool _passThrough;
+};
+
+#endif
@@ -0,0 +1,459 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CANPoller.h"
+
+#define OBD_RESPONSE_ID            0x7e8
+#define OBD_RESPONSE_MASK          0x7f8
+#define OBD_PHYSICAL_OFFSET        8
+
+#define POSITIVE_RESPONSE_OFFSET   0x40
+#define NEGATIVE_RESPONSE          0x7f
+#define NRC_RESPONSE_PENDING       0x78
+
+// Sentinel response ID of functional requests, answered by any OBD-II ECU.
+#define ANY_ECU                    -1
+
+CANPoller::CANPoller(MCP2515Class& can, CANPollSlot* slots, uint8_t capacity) :
+  _can(&can),
+  _slots(slots),
+  _capacity(capacity),
+  _count(0),
+  _onResponse(NULL),
+  _onResponseContext(NULL),
+  _p2Micros(CAN_POLL_P2_MILLIS * 1000UL),
+  _p2StarMicros(CAN_POLL_P2_STAR_MILLIS * 1000UL),
+  _startMillis(0)
+{
+}
+
+int CANPoller::add(long requestId, uint8_t service, uint16_t parameter, unsigned long intervalMillis,
+    long responseId)
+{
+  if (_count >= _capacity) {
+    return -1;
+  }
+
+  if (service != CAN_POLL_OBD_CURRENT_DATA && service != CAN_POLL_UDS_READ_DATA) {
+    return -1;
+  }
+
+  if (service == CAN_POLL_OBD_CURRENT_DATA && parameter > 0xff) {
+    return -1;
+  }
+
+  if (responseId == 0) {
+    responseId = (requestId == CAN_POLL_FUNCTIONAL_ID) ? ANY_ECU : requestId + OBD_PHYSICAL_OFFSET;
+  }
+
+  uint8_t index = _count;
+  CANPollSlot& slot = _slots[index];
+
+  memset(&slot, 0x00, sizeof(slot));
+  slot.requestId = requestId;
+  slot.responseId = responseId;
+  slot.service = service;
+  slot.parameter = parameter;
+  slot.intervalMicros = intervalMillis * 1000;
+  slot.minLatencyMicros = 0xffffffff;
+
+  slot.target = index;
+  for (uint8_t i = 0; i < index; i++) {
+    if (_slots[i].requestId == requestId) {
+      slot.target = _slots[i].target;
+      break;
+    }
+  }
+
+  _count++;
+
+  return index;
+}
+
+void CANPoller::clear()
+{
+  _count = 0;
+}
+
+void CANPoller::onResponse(CANPollHandler handler, void* context)
+{
+  _onResponse = handler;
+  _onResponseContext = context;
+}
+
+void CANPoller::setTimeouts(unsigned long p2Millis, unsigned long p2StarMillis)
+{
+  _p2Micros = p2Millis * 1000;
+  _p2StarMicros = p2StarMillis * 1000;
+}
+
+int CANPoller::begin()
+{
+  int ok = 1;
+
+  for (uint8_t i = 0; i < _count; i++) {
+    const CANPollSlot& slot = _slots[i];
+
+    if (slot.responseId == ANY_ECU) {
+      ok &= _can->onReceive(OBD_RESPONSE_ID, OBD_RESPONSE_MASK, onFrame, this);
+    } else {
+      ok &= _can->onReceive(slot.responseId, onFrame, this);
+    }
+  }
+
+  unsigned long now = micros();
+  for (uint8_t i = 0; i < _count; i++) {
+    _slots[i].pending = false;
+    _slots[i].dueMicros = now;
+  }
+  resetStatistics();
+
+  return ok;
+}
+
+int CANPoller::poll()
+{
+  unsigned long now = micros();
+  int sent = 0;
+
+  for (uint8_t i = 0; i < _count; i++) {
+    CANPollSlot& slot = _slots[i];
+
+    noInterrupts();
+    if (slot.pending && (long)(now - slot.deadlineMicros) >= 0) {
+      slot.pending = false;
+      slot.timeouts++;
+    }
+    interrupts();
+  }
+
+  // One pass per ECU: skip it while a request is outstanding, else send the
+  // request that is due first.
+  for (uint8_t i = 0; i < _count; i++) {
+    if (_slots[i].target != i || busy(i)) {
+      continue;
+    }
+
+    CANPollSlot* next = NULL;
+
+    for (uint8_t j = i; j < _count; j++) {
+      CANPollSlot& slot = _slots[j];
+
+      if (slot.target != i) {
+        continue;
+      }
+
+      if ((long)(now - slot.dueMicros) >= 0 &&
+          (next == NULL || (long)(slot.dueMicros - next->dueMicros) < 0)) {
+        next = &slot;
+      }
+    }
+
+    if (next == NULL) {
+      continue;
+    }
+
+    if (!send(*next, now)) {
+      // No free TX buffer; the other ECUs get theirs on the next call.
+      break;
+    }
+    sent++;
+  }
+
+  return sent;
+}
+
+bool CANPoller::busy(uint8_t target) const
+{
+  bool functional = (_slots[target].requestId == CAN_POLL_FUNCTIONAL_ID);
+  bool physical = isPhysicalObdId(_slots[target].requestId);
+
+  for (uint8_t i = 0; i < _count; i++) {
+    const CANPollSlot& slot = _slots[i];
+
+    if (!slot.pending) {
+      continue;
+    }
+
+    // Functional requests reach every OBD-II ECU, so they also wait for the
+    // physical requests to 0x7E0 to 0x7E7, and the other way around.
+    if (slot.target == target ||
+        (functional && isPhysicalObdId(slot.requestId)) ||
+        (physical && slot.requestId == CAN_POLL_FUNCTIONAL_ID)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool CANPoller::send(CANPollSlot& slot, unsigned long now)
+{
+  bool did = (slot.service == CAN_POLL_UDS_READ_DATA);
+
+  if (!_can->beginPacket(slot.requestId, 8)) {
+    return false;
+  }
+
+  // ISO-TP single frame: the length, the service and the PID/DID, padded to
+  // 8 bytes as ISO 15765-4 requires.
+  _can->write(did ? 3 : 2);
+  _can->write(slot.service);
+  if (did) {
+    _can->write(slot.parameter >> 8);
+  }
+  _can->write(slot.parameter & 0xff);
+  for (uint8_t i = did ? 4 : 3; i < 8; i++) {
+    _can->write(0x00);
+  }
+
+  // Pending before the request goes out, as the response may be handled from
+  // the receive interrupt before endPacket() returns.
+  unsigned long sentMicros = micros();
+  noInterrupts();
+  slot.pending = true;
+  slot.sentMicros = sentMicros;
+  slot.deadlineMicros = sentMicros + _p2Micros;
+  interrupts();
+
+  // A request no ECU acknowledges, e.g. with the ignition off, is aborted
+  // along with the wait for its response, rather than holding the TX buffer.
+  if (_can->endPacket(_p2Micros, CAN_TX_NO_WAIT) != CAN_TX_PENDING) {
+    slot.pending = false;
+    return false;
+  }
+
+  // Behind schedule, e.g. after timeouts, the parameter is due right away
+  // rather than for every sample missed.
+  slot.dueMicros += slot.intervalMicros;
+  if ((long)(now - slot.dueMicros) > 0) {
+    slot.dueMicros = now;
+  }
+
+  return true;
+}
+
+bool CANPoller::handleFrame(const CANFrame& frame)
+{
+  if (frame.extended || frame.rtr || frame.dlc < 3) {
+    return false;
+  }
+
+  // Only single frames; the first frames of multi-frame responses are left
+  // to time out.
+  uint8_t length = frame.data[0];
+  if (length > 7 || length + 1 > frame.dlc || length < 2) {
+    return false;
+  }
+
+  const uint8_t* payload = &frame.data[1];
+  unsigned long now = micros();
+
+  if (payload[0] == NEGATIVE_RESPONSE) {
+    if (length < 3) {
+      return false;
+    }
+
+    CANPollSlot* slot = findPending(frame.id, payload[1], NULL, 0);
+    if (slot == NULL) {
+      return false;
+    }
+
+    if (payload[2] == NRC_RESPONSE_PENDING) {
+      slot->deadlineMicros = now + _p2StarMicros;
+    } else {
+      slot->pending = false;
+      slot->negativeResponses++;
+      slot->lastNegativeResponse = payload[2];
+    }
+
+    return true;
+  }
+
+  if (payload[0] < POSITIVE_RESPONSE_OFFSET) {
+    return false;
+  }
+
+  uint8_t service = payload[0] - POSITIVE_RESPONSE_OFFSET;
+  uint8_t parameterLength = (service == CAN_POLL_UDS_READ_DATA) ? 2 : 1;
+  if (length < 1 + parameterLength) {
+    return false;
+  }
+
+  CANPollSlot* slot = findPending(frame.id, service, &payload[1], parameterLength);
+  if (slot == NULL) {
+    return false;
+  }
+
+  const uint8_t* data = &payload[1 + parameterLength];
+  uint8_t dataLength = length - 1 - parameterLength;
+  unsigned long latency = now - slot->sentMicros;
+
+  // Runs from the receive interrupt or from parsePacket() in loop(), so that
+  // poll() and read() only need to guard against the former.
+  slot->pending = false;
+  slot->received = true;
+  slot->length = dataLength;
+  memcpy(slot->data, data, dataLength);
+  slot->sequence++;
+
+  slot->samples++;
+  if (latency < slot->minLatencyMicros) {
+    slot->minLatencyMicros = latency;
+  }
+  if (latency > slot->maxLatencyMicros) {
+    slot->maxLatencyMicros = latency;
+  }
+  slot->sumLatencyMicros += latency;
+
+  if (_onResponse) {
+    _onResponse(slot - _slots, data, dataLength, _onResponseContext);
+  }
+
+  return true;
+}
+
+CANPollSlot* CANPoller::findPending(long responseId, uint8_t service, const uint8_t* parameter, uint8_t length)
+{
+  for (uint8_t i = 0; i < _count; i++) {
+    CANPollSlot& slot = _slots[i];
+
+    if (!slot.pending || slot.service != service || !matchesResponseId(slot, responseId)) {
+      continue;
+    }
+
+    // Negative responses do not repeat the PID/DID; there is only one request
+    // outstanding per ECU though.
+    if (parameter != NULL) {
+      uint16_t received = (length == 2) ? ((parameter[0] << 8) | parameter[1]) : parameter[0];
+      if (received != slot.parameter) {
+        continue;
+      }
+    }
+
+    return &slot;
+  }
+
+  return NULL;
+}
+
+bool CANPoller::isPhysicalObdId(long id)
+{
+  return (id & ~0x07) == (OBD_RESPONSE_ID - OBD_PHYSICAL_OFFSET);
+}
+
+bool CANPoller::matchesResponseId(const CANPollSlot& slot, long id)
+{
+  if (slot.responseId == ANY_ECU) {
+    return (id & OBD_RESPONSE_MASK) == OBD_RESPONSE_ID;
+  }
+
+  return slot.responseId == id;
+}
+
+void CANPoller::onFrame(const CANFrame& frame, void* context)
+{
+  ((CANPoller*)context)->handleFrame(frame);
+}
+
+int CANPoller::read(uint8_t index, uint8_t* data, uint8_t* length, uint16_t* sequence)
+{
+  if (index >= _count) {
+    return 0;
+  }
+
+  const CANPollSlot& slot = _slots[index];
+
+  noInterrupts();
+  bool received = slot.received;
+  if (received) {
+    memcpy(data, slot.data, slot.length);
+    *length = slot.length;
+    if (sequence) {
+      *sequence = slot.sequence;
+    }
+  }
+  interrupts();
+
+  return received ? 1 : 0;
+}
+
+float CANPoller::sampleRate(uint8_t index) const
+{
+  unsigned long elapsed = millis() - _startMillis;
+
+  if (index >= _count || elapsed == 0) {
+    return 0.0;
+  }
+
+  return _slots[index].samples * 1000.0 / elapsed;
+}
+
+float CANPoller::totalSampleRate() const
+{
+  float rate = 0.0;
+
+  for (uint8_t i = 0; i < _count; i++) {
+    rate += sampleRate(i);
+  }
+
+  return rate;
+}
+
+unsigned long CANPoller::samples(uint8_t index) const
+{
+  return (index < _count) ? _slots[index].samples : 0;
+}
+
+unsigned long CANPoller::timeouts(uint8_t index) const
+{
+  return (index < _count) ? _slots[index].timeouts : 0;
+}
+
+unsigned long CANPoller::negativeResponses(uint8_t index) const
+{
+  return (index < _count) ? _slots[index].negativeResponses : 0;
+}
+
+uint8_t CANPoller::lastNegativeResponse(uint8_t index) const
+{
+  return (index < _count) ? _slots[index].lastNegativeResponse : 0;
+}
+
+unsigned long CANPoller::minLatencyMicros(uint8_t index) const
+{
+  return (index < _count && _slots[index].samples) ? _slots[index].minLatencyMicros : 0;
+}
+
+unsigned long CANPoller::maxLatencyMicros(uint8_t index) const
+{
+  return (index < _count) ? _slots[index].maxLatencyMicros : 0;
+}
+
+unsigned long CANPoller::averageLatencyMicros(uint8_t index) const
+{
+  if (index >= _count || _slots[index].samples == 0) {
+    return 0;
+  }
+
+  return _slots[index].sumLatencyMicros / _slots[index].samples;
+}
+
+void CANPoller::resetStatistics()
+{
+  noInterrupts();
+  for (uint8_t i = 0; i < _count; i++) {
+    CANPollSlot& slot = _slots[i];
+
+    slot.samples = 0;
+    slot.timeouts = 0;
+    slot.negativeResponses = 0;
+    slot.lastNegativeResponse = 0;
+    slot.minLatencyMicros = 0xffffffff;
+    slot.maxLatencyMicros = 0;
+    slot.sumLatencyMicros = 0;
+  }
+  interrupts();
+
+  _startMillis = millis();
+}
@@ -0,0 +1,169 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_POLLER_H
+#define CAN_POLLER_H
+
+#include <Arduino.h>
+
+#include "MCP2515.h"
+
+// Services the poller can request and match responses of.
+#define CAN_POLL_OBD_CURRENT_DATA  0x01  // OBD-II mode 01, 8-bit PIDs
+#define CAN_POLL_UDS_READ_DATA     0x22  // UDS ReadDataByIdentifier, 16-bit DIDs
+
+// 11-bit OBD-II addressing: functional requests are answered by all ECUs, on
+// 0x7E8 to 0x7EF; physical requests to 0x7E0 + n are answered on 0x7E8 + n.
+#define CAN_POLL_FUNCTIONAL_ID     0x7df
+
+// Response timeouts. P2 is the time an ECU has to answer; after a "response
+// pending" negative response (NRC 0x78) it has P2* instead.
+#ifndef CAN_POLL_P2_MILLIS
+#define CAN_POLL_P2_MILLIS         50
+#endif
+
+#ifndef CAN_POLL_P2_STAR_MILLIS
+#define CAN_POLL_P2_STAR_MILLIS    5000
+#endif
+
+// Called with the data bytes following the service and PID/DID of a positive
+// response, e.g. the 2 bytes of PID 0x0C (engine speed).
+typedef void (*CANPollHandler)(uint8_t index, const uint8_t* data, uint8_t length, void* context);
+
+// Storage for one polled parameter. Treat as opaque; use the CANPoller
+// accessors.
+struct CANPollSlot {
+  long requestId;
+  long responseId;
+  uint8_t service;
+  uint16_t parameter;
+  unsigned long intervalMicros;
+  // Index of the first slot with the same request ID, i.e. the same ECU.
+  uint8_t target;
+
+  volatile bool pending;
+  unsigned long dueMicros;
+  unsigned long sentMicros;
+  unsigned long deadlineMicros;
+
+  volatile uint16_t sequence;
+  bool received;
+  uint8_t length;
+  uint8_t data[5];
+
+  unsigned long samples;
+  unsigned long timeouts;
+  unsigned long negativeResponses;
+  uint8_t lastNegativeResponse;
+  unsigned long minLatencyMicros;
+  unsigned long maxLatencyMicros;
+  uint64_t sumLatencyMicros;
+};
+
+// Polls OBD-II PIDs and UDS DIDs at the rates they are needed, keeping one
+// request outstanding per ECU instead of one on the whole bus.
+//
+// Each ECU answers one request at a time, so poll() sends the next request to
+// an ECU as soon as its previous one has been answered or has timed out, and
+// does not wait for the other ECUs meanwhile. ECUs are told apart by request
+// ID only; as functional requests (0x7DF) reach all OBD-II ECUs, they are not
+// outstanding together with physical requests to 0x7E0 to 0x7E7. Physical
+// requests to other IDs are assumed to address other ECUs. Of the parameters
+// of an ECU, it sends the one whose due time is earliest: a parameter polled
+// every 20 ms gets ahead of one polled every second, and with interval 0 the
+// parameters of an ECU are polled round robin as fast as it answers.
+//
+//   CANPollSlot slots[4];
+//   CANPoller poller(CAN, slots, 4);
+//
+//   CAN.setDispatcher(&dispatcher);
+//   poller.add(0x7e0, CAN_POLL_OBD_CURRENT_DATA, 0x0c, 20);   // engine speed, 50 Hz
+//   poller.add(0x7e0, CAN_POLL_OBD_CURRENT_DATA, 0x05, 1000); // coolant, 1 Hz
+//   poller.add(0x7e1, CAN_POLL_UDS_READ_DATA, 0xf190);        // as fast as possible
+//   poller.onResponse(onResponse);
+//   poller.begin();
+//   ...
+//   poller.poll();                        // from loop()
+//
+// Responses are matched to the outstanding request by the response ID, the
+// service and the PID/DID; late responses to a request that timed out are
+// dropped. Only single frame responses are matched, i.e. up to 5 data bytes
+// for OBD-II PIDs and 4 for UDS DIDs; ISO-TP multi-frame responses are
+// counted as timeouts. So are repeated identical responses while a
+// CANChangeFilter is attached with setChangeFilter(), as it drops them before
+// they reach the dispatcher; do not attach one while polling.
+class CANPoller {
+
+public:
+  CANPoller(MCP2515Class& can, CANPollSlot* slots, uint8_t capacity);
+
+  // Adds a parameter to poll every `intervalMillis`, or as often as possible
+  // if 0. Unless given, the response ID is the request ID + 8, or 0x7E8 to
+  // 0x7EF for CAN_POLL_FUNCTIONAL_ID. Returns the index of the parameter, or
+  // -1 if there is no free slot or the service is not supported.
+  int add(long requestId, uint8_t service, uint16_t parameter, unsigned long intervalMillis = 0,
+      long responseId = 0);
+  void clear();
+
+  void onResponse(CANPollHandler handler, void* context = NULL);
+  void setTimeouts(unsigned long p2Millis, unsigned long p2StarMillis);
+
+  // Registers the response IDs with the controller's dispatcher, one slot per
+  // distinct ID, and starts polling with all parameters due. Returns 0 if no
+  // dispatcher is attached; the responses then have to be passed to
+  // handleFrame().
+  int begin();
+
+  // Expires timed out requests and sends the requests that are due. Returns
+  // the number of requests sent.
+  int poll();
+
+  // Matches a received frame to an outstanding request. Returns false if the
+  // frame is not a response the poller waits for.
+  bool handleFrame(const CANFrame& frame);
+
+  // Copies the data of the latest positive response. Returns 0 if there is
+  // none yet. `sequence` is incremented on each response.
+  int read(uint8_t index, uint8_t* data, uint8_t* length, uint16_t* sequence = NULL);
+
+  // Per parameter statistics. The rate is in responses per second since
+  // begin() or resetStatistics(); the latency is from queueing the request to
+  // the response, in microseconds.
+  float sampleRate(uint8_t index) const;
+  float totalSampleRate() const;
+  unsigned long samples(uint8_t index) const;
+  unsigned long timeouts(uint8_t index) const;
+  unsigned long negativeResponses(uint8_t index) const;
+  uint8_t lastNegativeResponse(uint8_t index) const;
+  unsigned long minLatencyMicros(uint8_t index) const;
+  unsigned long maxLatencyMicros(uint8_t index) const;
+  unsigned long averageLatencyMicros(uint8_t index) const;
+
+  void resetStatistics();
+
+  uint8_t count() const { return _count; }
+
+private:
+  bool busy(uint8_t target) const;
+  bool send(CANPollSlot& slot, unsigned long now);
+  CANPollSlot* findPending(long responseId, uint8_t service, const uint8_t* parameter, uint8_t length);
+
+  static bool isPhysicalObdId(long id);
+  static bool matchesResponseId(const CANPollSlot& slot, long id);
+  static void onFrame(const CANFrame& frame, void* context);
+
+private:
+  MCP2515Class* _can;
+  CANPollSlot* _slots;
+  uint8_t _capacity;
+  uint8_t _count;
+
+  CANPollHandler _onResponse;
+  void* _onResponseContext;
+
+  unsigned long _p2Micros;
+  unsigned long _p2StarMicros;
+  unsigned long _startMillis;
+};
+
+#endif
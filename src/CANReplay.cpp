@@ -0,0 +1,189 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CANReplay.h"
+
+CANReplay::CANReplay(MCP2515Class& can) :
+  _can(&can),
+  _fromStream(false),
+  _frames(NULL),
+  _count(0),
+  _index(0),
+  _speedNumerator(1),
+  _speedDenominator(1),
+  _hasNext(false),
+  _firstTimestamp(0),
+  _startMicros(0),
+  _framesSent(0),
+  _minError(0),
+  _maxError(0),
+  _sumError(0),
+  _sumAbsoluteError(0)
+{
+}
+
+int CANReplay::begin(Stream& log)
+{
+  if (!_reader.begin(log)) {
+    _hasNext = false;
+    return 0;
+  }
+
+  _fromStream = true;
+
+  return start();
+}
+
+int CANReplay::begin(const CANReplayFrame* frames, size_t count)
+{
+  _fromStream = false;
+  _frames = frames;
+  _count = count;
+  _index = 0;
+
+  return start();
+}
+
+void CANReplay::setSpeed(unsigned int numerator, unsigned int denominator)
+{
+  _speedNumerator = numerator;
+  _speedDenominator = denominator ? denominator : 1;
+}
+
+bool CANReplay::poll()
+{
+  if (!_hasNext) {
+    return false;
+  }
+
+  unsigned long due = scheduledTime(_next.timestampMicros);
+  if ((long)(due - micros()) > CAN_REPLAY_SPIN_MICROS) {
+    return true;
+  }
+
+  // The MCP2515 sends higher numbered buffers first. Frames of the log still
+  // queued must go out before the next ones, so only the buffers numbered
+  // below the lowest queued one can be used.
+  uint8_t reserved = _can->reservedTxBuffers();
+  uint8_t queued = _can->pendingTxBuffers() & ~reserved;
+  uint8_t usable = 0x07 & ~reserved;
+  if (queued) {
+    usable &= (queued & -queued) - 1;
+  }
+  if (usable == 0) {
+    return true;
+  }
+
+  while ((long)(due - micros()) > 0) {
+    // Spin until the frame is due.
+  }
+
+  // Load every frame that is due by now into the usable buffers, from the
+  // highest down, which preserves the order of the log.
+  unsigned long dueTimes[3];
+  uint8_t loaded = 0;
+  uint8_t numLoaded = 0;
+  for (int n = 2; n >= 0 && _hasNext; n--) {
+    if (!(usable & (1 << n))) {
+      continue;
+    }
+
+    due = scheduledTime(_next.timestampMicros);
+    if (numLoaded > 0 && (long)(due - micros()) > 0) {
+      break;
+    }
+
+    _can->loadTxBuffer(n, _next.frame);
+    loaded |= (1 << n);
+    dueTimes[numLoaded++] = due;
+
+    readNext();
+  }
+
+  _can->requestToSend(loaded);
+  unsigned long sentMicros = micros();
+
+  for (uint8_t i = 0; i < numLoaded; i++) {
+    recordTimingError((long)(sentMicros - dueTimes[i]));
+  }
+
+  return _hasNext;
+}
+
+long CANReplay::averageTimingError() const
+{
+  if (_framesSent == 0) {
+    return 0;
+  }
+
+  return _sumError / (int64_t)_framesSent;
+}
+
+unsigned long CANReplay::averageAbsoluteTimingError() const
+{
+  if (_framesSent == 0) {
+    return 0;
+  }
+
+  return _sumAbsoluteError / _framesSent;
+}
+
+int CANReplay::start()
+{
+  _framesSent = 0;
+  _minError = 0;
+  _maxError = 0;
+  _sumError = 0;
+  _sumAbsoluteError = 0;
+
+  if (!readNext()) {
+    return 0;
+  }
+
+  _firstTimestamp = _next.timestampMicros;
+  _startMicros = micros();
+
+  return 1;
+}
+
+bool CANReplay::readNext()
+{
+  if (_fromStream) {
+    _hasNext = _reader.read(_next.frame, _next.timestampMicros);
+  } else if (_index < _count) {
+    _next = _frames[_index++];
+    _hasNext = true;
+  } else {
+    _hasNext = false;
+  }
+
+  return _hasNext;
+}
+
+unsigned long CANReplay::scheduledTime(unsigned long timestampMicros) const
+{
+  unsigned long elapsed = timestampMicros - _firstTimestamp;
+
+  if (_speedNumerator == 0) {
+    return _startMicros;
+  }
+  if (_speedNumerator == _speedDenominator) {
+    return _startMicros + elapsed;
+  }
+
+  return _startMicros + (unsigned long)((uint64_t)elapsed * _speedDenominator / _speedNumerator);
+}
+
+void CANReplay::recordTimingError(long error)
+{
+  if (_framesSent == 0 || error < _minError) {
+    _minError = error;
+  }
+  if (_framesSent == 0 || error > _maxError) {
+    _maxError = error;
+  }
+
+  _sumError += error;
+  _sumAbsoluteError += (error < 0) ? -error : error;
+  _framesSent++;
+}
@@ -0,0 +1,89 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_REPLAY_H
+#define CAN_REPLAY_H
+
+#include <Arduino.h>
+
+#include "CANLogger.h"
+#include "MCP2515.h"
+
+// When the next frame is due within this many microseconds, poll() busy-waits
+// for it instead of returning to loop(), so that the frame goes out on time.
+#ifndef CAN_REPLAY_SPIN_MICROS
+#define CAN_REPLAY_SPIN_MICROS 200
+#endif
+
+// A frame of an in-memory log.
+struct CANReplayFrame {
+  unsigned long timestampMicros;
+  CANFrame frame;
+};
+
+// Replays a recorded log onto the bus, reproducing the original inter-frame
+// timing. Frames that are due at the same time are loaded into the free TX
+// buffers of the MCP2515 and started with a single RTS instruction. Only
+// buffers numbered below the lowest one still holding a log frame are used,
+// so that the frames go out in log order.
+//
+// The replay owns the TX buffers while it runs; don't call endPacket() at the
+// same time.
+class CANReplay {
+
+public:
+  explicit CANReplay(MCP2515Class& can);
+
+  // Replays a capture written by CANLogger.
+  int begin(Stream& log);
+  // Replays `count` frames from memory, ordered by timestamp.
+  int begin(const CANReplayFrame* frames, size_t count);
+
+  // Replays `numerator / denominator` times faster than real time.
+  // A numerator of 0 sends every frame as soon as a TX buffer is free.
+  void setSpeed(unsigned int numerator, unsigned int denominator = 1);
+
+  // Sends all frames that are due. Call from loop(). Returns false once the
+  // whole log has been sent.
+  bool poll();
+  bool finished() const { return !_hasNext; }
+
+  unsigned long framesSent() const { return _framesSent; }
+  // Difference between the actual and the scheduled send time of the frames
+  // sent so far, in microseconds. Positive values mean late.
+  long minTimingError() const { return _minError; }
+  long maxTimingError() const { return _maxError; }
+  long averageTimingError() const;
+  unsigned long averageAbsoluteTimingError() const;
+
+private:
+  int start();
+  bool readNext();
+  unsigned long scheduledTime(unsigned long timestampMicros) const;
+  void recordTimingError(long error);
+
+private:
+  MCP2515Class* _can;
+
+  CANLogReader _reader;
+  bool _fromStream;
+  const CANReplayFrame* _frames;
+  size_t _count;
+  size_t _index;
+
+  unsigned int _speedNumerator;
+  unsigned int _speedDenominator;
+
+  bool _hasNext;
+  CANReplayFrame _next;
+  unsigned long _firstTimestamp;
+  unsigned long _startMicros;
+
+  unsigned long _framesSent;
+  long _minError;
+  long _maxError;
+  int64_t _sumError;
+  uint64_t _sumAbsoluteError;
+};
+
+#endif
@@ -0,0 +1,89 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CANSPIBus.h"
+#include "MCP2515.h"
+
+CANSPIBus::CANSPIBus() :
+  _can(NULL),
+  _lockDepth(0),
+  _deferred(false),
+  _deferredMicros(0),
+  _lockStartMicros(0)
+{
+  resetStatistics();
+}
+
+void CANSPIBus::lock()
+{
+  if (_lockDepth == 0) {
+    _lockStartMicros = micros();
+  }
+  acquire();
+}
+
+void CANSPIBus::unlock()
+{
+  if (_lockDepth == 0) {
+    return;
+  }
+
+  if (_lockDepth == 1) {
+    unsigned long held = micros() - _lockStartMicros;
+    if (held > _maxLockMicros) {
+      _maxLockMicros = held;
+    }
+    _sumLockMicros += held;
+    _locks++;
+  }
+
+  release();
+}
+
+unsigned long CANSPIBus::averageLockMicros() const
+{
+  return _locks ? _sumLockMicros / _locks : 0;
+}
+
+void CANSPIBus::resetStatistics()
+{
+  _locks = 0;
+  _maxLockMicros = 0;
+  _sumLockMicros = 0;
+  _deferrals = 0;
+  _maxDeferralMicros = 0;
+}
+
+void CANSPIBus::release()
+{
+  // The CAN interrupt is disabled while a drain is deferred, so _deferred
+  // cannot change under us once the bus is free.
+  if (--_lockDepth > 0 || !_deferred) {
+    return;
+  }
+  _deferred = false;
+
+  unsigned long waited = micros() - _deferredMicros;
+  if (waited > _maxDeferralMicros) {
+    _maxDeferralMicros = waited;
+  }
+
+  if (_can) {
+    _can->runDeferredInterrupt();
+  }
+}
+
+bool CANSPIBus::defer()
+{
+  if (_lockDepth == 0) {
+    return false;
+  }
+
+  if (!_deferred) {
+    _deferred = true;
+    _deferredMicros = micros();
+    _deferrals++;
+  }
+
+  return true;
+}
@@ -0,0 +1,77 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_SPI_BUS_H
+#define CAN_SPI_BUS_H
+
+#include <Arduino.h>
+
+class MCP2515Class;
+
+// Coordinates the MCP2515 receive interrupt with other devices on the same
+// SPI bus, e.g. an SD card.
+//
+// The other devices wrap their SPI work in lock()/unlock(). When the CAN
+// interrupt fires while the bus is locked, the driver does not touch SPI:
+// it disables its own interrupt and leaves the drain of the RX buffers to
+// unlock(), which runs it as soon as the bus is released. No other interrupt
+// is masked, and neither device's transfers get interleaved.
+//
+//   CANSPIBus spiBus;
+//
+//   CAN.setSPIBus(&spiBus);               // before onReceive()
+//   CAN.onReceive(onReceive);
+//   ...
+//   spiBus.lock();
+//   file.write(buffer, length);
+//   spiBus.unlock();                      // runs a deferred drain, if any
+//
+// The statistics tell how long the other devices hold the bus, and how long
+// the frames had to wait for it. Frames lost while waiting are counted by
+// MCP2515Class::rxOverflows().
+class CANSPIBus {
+
+public:
+  CANSPIBus();
+
+  // Calls nest; only the outermost pair is timed.
+  void lock();
+  void unlock();
+  bool locked() const { return _lockDepth > 0; }
+
+  // Bus holds through lock()/unlock(), e.g. SD writes, in microseconds.
+  unsigned long locks() const { return _locks; }
+  unsigned long maxLockMicros() const { return _maxLockMicros; }
+  unsigned long averageLockMicros() const;
+
+  // CAN interrupts that found the bus locked, and the longest time from such
+  // an interrupt to the drain.
+  unsigned long deferrals() const { return _deferrals; }
+  unsigned long maxDeferralMicros() const { return _maxDeferralMicros; }
+
+  void resetStatistics();
+
+private:
+  friend class MCP2515Class;
+
+  // Used by the driver around its own transactions; not timed.
+  void acquire() { _lockDepth++; }
+  void release();
+  // Called from the CAN interrupt. Returns false if the bus is free.
+  bool defer();
+
+private:
+  MCP2515Class* _can;
+  volatile uint8_t _lockDepth;
+  volatile bool _deferred;
+  unsigned long _deferredMicros;
+  unsigned long _lockStartMicros;
+
+  unsigned long _locks;
+  unsigned long _maxLockMicros;
+  uint64_t _sumLockMicros;
+  unsigned long _deferrals;
+  unsigned long _maxDeferralMicros;
+};
+
+#endif
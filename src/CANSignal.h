@@ -0,0 +1,188 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_SIGNAL_H
+#define CAN_SIGNAL_H
+
+#include <Arduino.h>
+
+#include "CANController.h"
+
+// Byte orders of a signal, as in DBC files.
+#define CAN_LITTLE_ENDIAN          0  // Intel, DBC "@1"
+#define CAN_BIG_ENDIAN             1  // Motorola, DBC "@0"
+
+// One byte of a signal's bits. The recursion over the bytes is resolved at
+// compile time, so that packing and unpacking compile to straight-line code
+// with constant shifts and masks.
+//
+// Bits are numbered in transmission order: for little endian signals, `Begin`
+// is the start bit (the LSB); for big endian signals, bit 7 of byte 0 is 0,
+// bit 0 of byte 0 is 7, bit 7 of byte 1 is 8 and so on, and `Begin` is the
+// MSB.
+template <uint8_t ByteOrder, uint8_t Begin, uint8_t Length, uint8_t Byte, uint8_t LastByte,
+    bool Done = (Byte > LastByte)>
+struct CANSignalBytes {
+  static const uint8_t Low = (Byte * 8 > Begin) ? Byte * 8 : Begin;
+  static const uint8_t High = (Byte * 8 + 8 < Begin + Length) ? Byte * 8 + 8 : Begin + Length;
+  static const uint8_t Mask = (1U << (High - Low)) - 1;
+  static const uint8_t ByteShift = (ByteOrder == CAN_BIG_ENDIAN) ? Byte * 8 + 8 - High : Low - Byte * 8;
+  static const uint8_t ValueShift = (ByteOrder == CAN_BIG_ENDIAN) ? Begin + Length - High : Low - Begin;
+
+  typedef CANSignalBytes<ByteOrder, Begin, Length, Byte + 1, LastByte> Next;
+
+  static inline uint32_t extract(const uint8_t* data)
+  {
+    return ((uint32_t)((data[Byte] >> ByteShift) & Mask) << ValueShift) | Next::extract(data);
+  }
+
+  static inline void insert(uint8_t* data, uint32_t raw)
+  {
+    data[Byte] = (data[Byte] & (uint8_t)~(Mask << ByteShift)) |
+        (uint8_t)(((raw >> ValueShift) & Mask) << ByteShift);
+    Next::insert(data, raw);
+  }
+};
+
+template <uint8_t ByteOrder, uint8_t Begin, uint8_t Length, uint8_t Byte, uint8_t LastByte>
+struct CANSignalBytes<ByteOrder, Begin, Length, Byte, LastByte, true> {
+  static inline uint32_t extract(const uint8_t* /*data*/) { return 0; }
+  static inline void insert(uint8_t* /*data*/, uint32_t /*raw*/) {}
+};
+
+// A signal of a CAN message, defined like a DBC entry:
+//
+//   SG_ Rpm : 16|14@1+ (1,0) [0|16383] "rpm"
+//   SG_ Oil : 16|8@1+ (1,-40) [-40|215] "degC"
+//
+//   typedef CANSignal<16, 14> Rpm;
+//   typedef CANSignal<16, 8, CAN_LITTLE_ENDIAN, false, 1, 1, -40> Oil;
+//
+//   uint16_t rpm = Rpm::get(frame.data);
+//   Oil::set(frame.data, 100);
+//
+// `StartBit` uses the DBC numbering (bit n of byte b is b * 8 + n), and is the
+// LSB for little endian signals and the MSB for big endian ones.
+//
+// The physical value is `raw * FactorNumerator / FactorDenominator + Offset`,
+// computed in 32-bit integer arithmetic: pick the factor so that the physical
+// value is an integer in the unit you need, e.g. 1/10 degrees rather than
+// degrees with a factor of 0.1. get() and set() then need no floating point,
+// and divisions by a constant power of two become shifts. getFloat() and
+// setFloat() are there for the cases where the precision of a float matters
+// more than speed.
+//
+// Values that do not fit the signal are truncated to its length, like DBC
+// tools do; no range checks are made.
+template <uint8_t StartBit, uint8_t Length, uint8_t ByteOrder = CAN_LITTLE_ENDIAN, bool Signed = false,
+    long FactorNumerator = 1, long FactorDenominator = 1, long Offset = 0>
+struct CANSignal {
+  static_assert(Length >= 1 && Length <= 32, "CAN signals are 1 to 32 bits long");
+  static_assert(StartBit < 64, "CAN signals start within the 8 data bytes");
+  static_assert(FactorNumerator != 0 && FactorDenominator != 0, "the factor must not be 0");
+
+  // Position of the signal in transmission order, see CANSignalBytes.
+  static const uint8_t Begin = (ByteOrder == CAN_BIG_ENDIAN) ? (StartBit & ~0x07) + 7 - (StartBit & 0x07) : StartBit;
+  static const uint8_t FirstByte = Begin / 8;
+  static const uint8_t LastByte = (Begin + Length - 1) / 8;
+
+  static_assert(Begin + Length <= 64, "CAN signals end within the 8 data bytes");
+
+  typedef CANSignalBytes<ByteOrder, Begin, Length, FirstByte, LastByte> Bytes;
+
+  static const uint32_t RawMask = (Length == 32) ? 0xffffffffUL : ((1UL << (Length & 31)) - 1);
+  static const uint32_t SignBit = 1UL << (Length - 1);
+
+  // Number of data bytes the signal needs, e.g. for the DLC.
+  static const uint8_t MinDlc = LastByte + 1;
+
+  static inline uint32_t getRaw(const uint8_t* data)
+  {
+    return Bytes::extract(data);
+  }
+
+  static inline void setRaw(uint8_t* data, uint32_t raw)
+  {
+    Bytes::insert(data, raw);
+  }
+
+  static inline long get(const uint8_t* data)
+  {
+    return scale(getRaw(data));
+  }
+
+  static inline void set(uint8_t* data, long value)
+  {
+    setRaw(data, unscale(value));
+  }
+
+  static inline float getFloat(const uint8_t* data)
+  {
+    return signExtend(getRaw(data)) * ((float)FactorNumerator / FactorDenominator) + Offset;
+  }
+
+  static inline void setFloat(uint8_t* data, float value)
+  {
+    setRaw(data, (uint32_t)(long)((value - Offset) * ((float)FactorDenominator / FactorNumerator)));
+  }
+
+  static inline long get(const CANFrame& frame) { return get(frame.data); }
+  static inline void set(CANFrame& frame, long value) { set(frame.data, value); }
+  static inline float getFloat(const CANFrame& frame) { return getFloat(frame.data); }
+  static inline void setFloat(CANFrame& frame, float value) { setFloat(frame.data, value); }
+
+  // Physical value of a raw value, and the other way around.
+  static inline long scale(uint32_t raw)
+  {
+    return signExtend(raw) * FactorNumerator / FactorDenominator + Offset;
+  }
+
+  static inline uint32_t unscale(long value)
+  {
+    return (uint32_t)((value - Offset) * FactorDenominator / FactorNumerator) & RawMask;
+  }
+
+  static inline long signExtend(uint32_t raw)
+  {
+    // Branch-free: flipping the sign bit and subtracting it again extends it.
+    return Signed ? (long)(int32_t)((raw ^ SignBit) - SignBit) : (long)raw;
+  }
+};
+
+// A message: its ID and DLC, to which the signals are added as typedefs.
+//
+//   struct Engine : CANMessage<0x140, 8> {
+//     typedef CANSignal<0, 8, CAN_LITTLE_ENDIAN, false, 100, 255> AcceleratorPedal;  // %
+//     typedef CANSignal<15, 1> ClutchDown;
+//     typedef CANSignal<16, 14> Rpm;
+//   };
+//
+//   CANFrame frame;
+//   Engine::init(frame);
+//   Engine::AcceleratorPedal::set(frame, 42);
+//   Engine::Rpm::set(frame, 3456);
+//   CAN.sendFrame(frame);
+template <long Id, uint8_t Dlc = 8, bool Extended = false>
+struct CANMessage {
+  static_assert(Dlc <= 8, "CAN messages carry up to 8 data bytes");
+
+  static const long MessageId = Id;
+  static const uint8_t MessageDlc = Dlc;
+
+  // Sets the ID and DLC, and clears the data.
+  static inline void init(CANFrame& frame)
+  {
+    frame.id = Id;
+    frame.extended = Extended;
+    frame.rtr = false;
+    frame.dlc = Dlc;
+    memset(frame.data, 0x00, sizeof(frame.data));
+  }
+
+  static inline bool matches(const CANFrame& frame)
+  {
+    return frame.id == Id && frame.extended == Extended && !frame.rtr && frame.dlc >= Dlc;
+  }
+};
+
+#endif
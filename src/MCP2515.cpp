@@ -2,12 +2,17 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
 #include "MCP2515.h"
+#include "CANSPIBus.h"
 
 #define REG_BFPCTRL                0x0c
 #define REG_TXRTSCTRL              0x0d
 
+#define REG_CANSTAT                0x0e
 #define REG_CANCTRL                0x0f
 
+#define REG_TEC                    0x1c
+#define REG_REC                    0x1d
+
 #define REG_CNF3                   0x28
 #define REG_CNF2                   0x29
 #define REG_CNF1                   0x2a
@@ -17,9 +22,23 @@
 // Whenever changing the CANINTF register, use BIT MODIFY instead of WRITE.
 #define REG_CANINTF                0x2c
 
+#define REG_EFLG                   0x2d
+
 #define FLAG_RXnIE(n)              (0x01 << n)
 #define FLAG_RXnIF(n)              (0x01 << n)
 #define FLAG_TXnIF(n)              (0x04 << n)
+#define FLAG_ERRIE                 0x20
+#define FLAG_ERRIF                 0x20
+#define FLAG_WAKIE                 0x40
+#define FLAG_WAKIF                 0x40
+
+#define FLAG_CNF3_WAKFIL           0x40
+
+#define FLAG_EFLG_RXnOVR(n)        (0x40 << n)
+#define FLAG_EFLG_TXBO             0x20
+#define FLAG_EFLG_TXEP             0x10
+#define FLAG_EFLG_RXEP             0x08
+#define FLAG_EFLG_EWARN            0x01
 
 // There is a 4-register gap between RXF2EID0 and RXF3SIDH.
 #define REG_RXFnSIDH(n)            (0x00 + ((n + (n >= 3)) * 4))
@@ -54,19 +73,71 @@
 #define FLAG_EXIDE                 0x08
 #define FLAG_RXB0CTRL_BUKT         0x04
 
+#define FLAG_BFPCTRL_BnBFE(n)      (0x04 << n)
+#define FLAG_BFPCTRL_BnBFM(n)      (0x01 << n)
+
 #define FLAG_RXM0                  0x20
 #define FLAG_RXM1                  0x40
 
+// REQOP (CANCTRL[7:5]) and OPMODE (CANSTAT[7:5]) values.
+#define MODE_MASK                  0xe0
+#define MODE_NORMAL                0x00
+#define MODE_SLEEP                 0x20
+#define MODE_LOOPBACK              0x40
+#define MODE_LISTEN_ONLY           0x60
+#define MODE_CONFIGURATION         0x80
+
+// The controller only changes modes once the frame in progress is done, which
+// takes up to ~30 ms at 5 kbps.
+#define MODE_CHANGE_TIMEOUT_MILLIS 50
+
 
 MCP2515Class::MCP2515Class(SPIClass& spi) :
   CANControllerClass(),
   _spi(&spi),
   _spiSettings(10E6, MSBFIRST, SPI_MODE0),
+  _spiBus(NULL),
   _csPin(MCP2515_DEFAULT_CS_PIN),
   _intPin(MCP2515_DEFAULT_INT_PIN),
+  _rx0bfPin(-1),
+  _rx1bfPin(-1),
   _clockFrequency(MCP2515_DEFAULT_CLOCK_FREQUENCY),
-  _tx_response_timeout(50)
+  _tx_response_timeout(50),
+  _reservedTxBuffers(0),
+  _rtsPinBuffers(0),
+  _autoResponses(NULL),
+  _autoResponseCount(0),
+  _armedAutoResponse(-1),
+  _autoResponsesSent(0),
+  _autoResponsesMissed(0),
+  _onTransmit(NULL),
+  _oneShotMode(false),
+  _trackedTxBuffers(0),
+  _expiredTxBuffers(0),
+  _errorState(CAN_ERROR_ACTIVE),
+  _onErrorStateChange(NULL),
+  _busOffMillis(0),
+  _busOffRecoveryMinDelay(0),
+  _busOffRecoveryMaxDelay(0),
+  _busOffRecoveryDelay(0),
+  _busOffRecoveries(0),
+  _rxOverflows(0),
+  _rxPollQuietMicros(0),
+  _rxPollWeight(MCP2515_RX_POLL_WEIGHT),
+  _rxInterrupts(0),
+  _rxPolledFrames(0),
+  _configured(false),
+  _wakeOnCAN(false),
+  _wakeUps(0),
+  _configurationRepairs(0),
+  _acceptanceShadowValid(false)
 {
+  memset(_errorStateCounts, 0x00, sizeof(_errorStateCounts));
+  memset(_controlShadow, 0x00, sizeof(_controlShadow));
+  memset(_pinControlShadow, 0x00, sizeof(_pinControlShadow));
+  memset(_filterShadow, 0x00, sizeof(_filterShadow));
+  memset(_maskShadow, 0x00, sizeof(_maskShadow));
+  memset(_rxbCtrlShadow, 0x00, sizeof(_rxbCtrlShadow));
 }
 
 MCP2515Class::~MCP2515Class()
@@ -77,6 +148,8 @@ int MCP2515Class::begin(long baudRate, bool stayInConfigurationMode)
 {
   CANControllerClass::begin(baudRate);
 
+  _configured = false;
+
   pinMode(_csPin, OUTPUT);
 
   // start SPI
@@ -84,6 +157,17 @@ int MCP2515Class::begin(long baudRate, bool stayInConfigurationMode)
 
   reset();
 
+  // The reset leaves CLKOUT enabled at /8; turn it off, as mode switches only
+  // change REQOP from here on.
+  modifyRegister(REG_CANCTRL, 0x07, 0x00);
+
+  // The reset cleared the TX buffers, OSM and the error counters.
+  _oneShotMode = false;
+  _trackedTxBuffers = 0;
+  _expiredTxBuffers = 0;
+  _errorState = CAN_ERROR_ACTIVE;
+  _busOffRecoveryDelay = _busOffRecoveryMinDelay;
+
   if (!switchToConfigurationMode()) {
     return 0;
   }
@@ -133,18 +217,38 @@ int MCP2515Class::begin(long baudRate, bool stayInConfigurationMode)
     return 0;
   }
 
-  writeRegister(REG_CNF1, cnf[0]);
-  writeRegister(REG_CNF2, cnf[1]);
-  writeRegister(REG_CNF3, cnf[2]);
+  // CNF3, CNF2, CNF1 and CANINTE are consecutive registers.
+  _controlShadow[0] = cnf[2] | (_wakeOnCAN ? FLAG_CNF3_WAKFIL : 0);
+  _controlShadow[1] = cnf[1];
+  _controlShadow[2] = cnf[0];
+  _controlShadow[3] = FLAG_RXnIE(1) | FLAG_RXnIE(0) | FLAG_ERRIE | (_wakeOnCAN ? FLAG_WAKIE : 0);
+  writeRegisters(REG_CNF3, _controlShadow, 4);
 
-  writeRegister(REG_CANINTE, FLAG_RXnIE(1) | FLAG_RXnIE(0));
-  writeRegister(REG_BFPCTRL, 0x00);
-  writeRegister(REG_TXRTSCTRL, 0x00);
+  // In interrupt mode (BnBFM), RXnBF is low while RXnIF is set.
+  uint8_t regBFPCTRL = 0x00;
+  for (int n = 0; n < 2; n++) {
+    int pin = n ? _rx1bfPin : _rx0bfPin;
+    if (pin >= 0) {
+      pinMode(pin, INPUT);
+      regBFPCTRL |= FLAG_BFPCTRL_BnBFE(n) | FLAG_BFPCTRL_BnBFM(n);
+    }
+  }
+  _pinControlShadow[0] = regBFPCTRL;
+  _pinControlShadow[1] = _rtsPinBuffers;
+  writeRegisters(REG_BFPCTRL, _pinControlShadow, 2);
 
   // A combination of RXM1 and RXM0 is "Turns mask/filters off; receives any message".
   // BUKT enabled to allow rollover of received messages from RX0 into RX1 (small HW buffer)
   writeRegister(REG_RXBnCTRL(0), FLAG_RXM1 | FLAG_RXM0 | FLAG_RXB0CTRL_BUKT);
   writeRegister(REG_RXBnCTRL(1), FLAG_RXM1 | FLAG_RXM0);
+  _rxbCtrlShadow[0] = FLAG_RXM1 | FLAG_RXM0 | FLAG_RXB0CTRL_BUKT;
+  _rxbCtrlShadow[1] = FLAG_RXM1 | FLAG_RXM0;
+  // Filters and masks are undefined after a reset.
+  _acceptanceShadowValid = false;
+
+  if (_autoResponseCount && !setAutoResponses(_autoResponses, _autoResponseCount)) {
+    return 0;
+  }
 
   if (!stayInConfigurationMode) {
     if (!switchToNormalMode()) {
@@ -152,57 +256,324 @@ int MCP2515Class::begin(long baudRate, bool stayInConfigurationMode)
     }
   }
 
+  _configured = true;
+
   return 1;
 }
 
 void MCP2515Class::end()
 {
+  _configured = false;
+
   _spi->end();
 
   CANControllerClass::end();
 }
 
 int MCP2515Class::endPacket()
+{
+  return (endPacket(0, 0) == CAN_TX_SENT) ? 1 : 0;
+}
+
+int MCP2515Class::endPacket(unsigned long timeoutMicros, uint8_t flags)
 {
   if (!CANControllerClass::endPacket()) {
     return 0;
   }
 
-  // Currently, we don't need to use more than one TX buffer as we always wait
-  // until the data has been fully transmitted. For the same reason, we don't
-  // need to check in the beginning whether there is any data in the TX buffer
-  // pending transmission. The performance can be optimized by utilizing all
-  // three TX buffers of the MCP2515, but this will come at extra complexity.
+  // Fail right away while the controller is bus-off, instead of waiting for
+  // the timeout of every frame.
+  if (_errorState == CAN_BUS_OFF && pollErrors() == CAN_BUS_OFF) {
+    return (flags & CAN_TX_NO_WAIT) ? 0 : CAN_TX_ERROR;
+  }
+
+  // Settle the outcome of earlier fire-and-forget frames, so that their
+  // buffers can be reused.
+  if (_trackedTxBuffers) {
+    pollTransmit();
+  }
+
+  // Use the lowest free buffer. Without fire-and-forget frames, this is
+  // always TXB0, as we wait for blocking frames to be fully transmitted.
+  uint8_t busy = pendingTxBuffers() | _reservedTxBuffers | _trackedTxBuffers;
   int n = 0;
+  while (n < 3 && (busy & (1 << n))) {
+    n++;
+  }
+  if (n == 3) {
+    return 0;
+  }
+
+  CANFrame frame;
+  frame.id = _txId;
+  frame.extended = _txExtended;
+  frame.rtr = _txRtr;
+  frame.dlc = _txLength;
+  memcpy(frame.data, _txData, sizeof(frame.data));
+
+  loadTxBuffer(n, frame);
+  setOneShotMode(flags & CAN_TX_ONE_SHOT);
+  // TXnIF is only set on a successful transmission, which is how the outcome
+  // is told apart from an abort later on.
+  modifyRegister(REG_CANINTF, FLAG_TXnIF(n), 0x00);
+  unsigned long startMicros = micros();
+  requestToSend(1 << n);
+
+  if (timeoutMicros == 0) {
+    timeoutMicros = _tx_response_timeout * 1000UL;
+  }
+
+  if (flags & CAN_TX_NO_WAIT) {
+    _trackedTxBuffers |= (1 << n);
+    _expiredTxBuffers &= ~(1 << n);
+    _txIds[n] = frame.id;
+    _txStartMicros[n] = startMicros;
+    _txTimeoutMicros[n] = timeoutMicros;
+    return CAN_TX_PENDING;
+  }
+
+  // Wait until the transmission completes, or gets aborted.
+  // Transmission is pending while TXREQ (TXBnCTRL[3]) bit is set.
+  bool aborted = false;
+  bool expired = false;
+  uint8_t regCTRL;
+  while ((regCTRL = readRegister(REG_TXBnCTRL(n))) & 0x08) {
+    if (!aborted) {
+      // Read the TXERR (TXBnCTRL[4]) bit to check for errors, and check for
+      // timeout. Either way, only this buffer is aborted; the MCP2515 will
+      // clear the TXREQ bit shortly.
+      if (regCTRL & 0x10) {
+        abortTxBuffer(n);
+        aborted = true;
+      } else if (micros() - startMicros > timeoutMicros) {
+        abortTxBuffer(n);
+        aborted = true;
+        expired = true;
+      }
+    }
+
+    yield();
+  }
+
+  int outcome = txOutcome(n, regCTRL, expired);
+  if (outcome != CAN_TX_SENT) {
+    // Pick up a transition to bus-off without waiting for the interrupt.
+    updateErrorState();
+  }
+
+  return outcome;
+}
+
+int MCP2515Class::pollTransmit()
+{
+  if (!_trackedTxBuffers) {
+    return 0;
+  }
+
+  int completed = 0;
+  uint8_t pending = pendingTxBuffers();
+  for (int n = 0; n < 3; n++) {
+    uint8_t bit = (1 << n);
+    if (!(_trackedTxBuffers & bit)) {
+      continue;
+    }
+
+    if (pending & bit) {
+      if (!(_expiredTxBuffers & bit) &&
+          micros() - _txStartMicros[n] > _txTimeoutMicros[n]) {
+        abortTxBuffer(n);
+        _expiredTxBuffers |= bit;
+      }
+      continue;
+    }
+
+    int outcome = txOutcome(n, readRegister(REG_TXBnCTRL(n)), _expiredTxBuffers & bit);
+    _trackedTxBuffers &= ~bit;
+    _expiredTxBuffers &= ~bit;
+    completed++;
+
+    if (_onTransmit) {
+      _onTransmit(_txIds[n], outcome);
+    }
+  }
+
+  return completed;
+}
+
+int MCP2515Class::pollErrors()
+{
+  // While the controller is not error active, EFLG is watched directly, as
+  // the way back to error active does not raise ERRIF.
+  if (_errorState != CAN_ERROR_ACTIVE || (readRegister(REG_CANINTF) & FLAG_ERRIF)) {
+    updateErrorState();
+  }
+
+  if (_errorState == CAN_BUS_OFF && _busOffRecoveryMinDelay &&
+      millis() - _busOffMillis >= _busOffRecoveryDelay) {
+    // Re-initialize through configuration mode rather than a full begin(),
+    // which keeps bit timing, filters and TX buffers.
+    _busOffRecoveries++;
+    if (switchToConfigurationMode()) {
+      switchToNormalMode();
+    }
+
+    updateErrorState();
+    if (_errorState == CAN_BUS_OFF) {
+      // Still bus-off: back off exponentially.
+      _busOffMillis = millis();
+      _busOffRecoveryDelay *= 2;
+      if (_busOffRecoveryDelay > _busOffRecoveryMaxDelay) {
+        _busOffRecoveryDelay = _busOffRecoveryMaxDelay;
+      }
+    }
+  }
+
+  return _errorState;
+}
+
+void MCP2515Class::setBusOffRecovery(unsigned long delayMillis, unsigned long maxDelayMillis)
+{
+  _busOffRecoveryMinDelay = delayMillis;
+  _busOffRecoveryMaxDelay = maxDelayMillis > delayMillis ? maxDelayMillis : delayMillis;
+  _busOffRecoveryDelay = delayMillis;
+}
+
+void MCP2515Class::onErrorStateChange(void(*callback)(int state, int previousState))
+{
+  _onErrorStateChange = callback;
+}
+
+int MCP2515Class::transmitErrorCount()
+{
+  return readRegister(REG_TEC);
+}
+
+int MCP2515Class::receiveErrorCount()
+{
+  return readRegister(REG_REC);
+}
+
+void MCP2515Class::updateErrorState()
+{
+  uint8_t regEFLG = readRegister(REG_EFLG);
+
+  // The RXnOVR bits have to be cleared by software.
+  uint8_t overflows = regEFLG & (FLAG_EFLG_RXnOVR(0) | FLAG_EFLG_RXnOVR(1));
+  if (overflows) {
+    if (overflows & FLAG_EFLG_RXnOVR(0)) {
+      _rxOverflows++;
+    }
+    if (overflows & FLAG_EFLG_RXnOVR(1)) {
+      _rxOverflows++;
+    }
+    modifyRegister(REG_EFLG, overflows, 0x00);
+  }
+  modifyRegister(REG_CANINTF, FLAG_ERRIF, 0x00);
+
+  int state;
+  if (regEFLG & FLAG_EFLG_TXBO) {
+    state = CAN_BUS_OFF;
+  } else if (regEFLG & (FLAG_EFLG_TXEP | FLAG_EFLG_RXEP)) {
+    state = CAN_ERROR_PASSIVE;
+  } else if (regEFLG & FLAG_EFLG_EWARN) {
+    state = CAN_ERROR_WARNING;
+  } else {
+    state = CAN_ERROR_ACTIVE;
+  }
+
+  if (state == _errorState) {
+    return;
+  }
+
+  int previousState = _errorState;
+  _errorState = state;
+  _errorStateCounts[state]++;
+
+  if (state == CAN_BUS_OFF) {
+    _busOffMillis = millis();
+  } else if (state == CAN_ERROR_ACTIVE) {
+    _busOffRecoveryDelay = _busOffRecoveryMinDelay;
+  }
+
+  if (_onErrorStateChange) {
+    _onErrorStateChange(state, previousState);
+  }
+}
+
+void MCP2515Class::onTransmit(void(*callback)(long, int))
+{
+  _onTransmit = callback;
+}
+
+void MCP2515Class::setOneShotMode(bool oneShot)
+{
+  // OSM (CANCTRL[3]) applies to all TX buffers at once, so only touch it
+  // when it actually changes.
+  if (oneShot == _oneShotMode) {
+    return;
+  }
+
+  modifyRegister(REG_CANCTRL, 0x08, oneShot ? 0x08 : 0x00);
+  _oneShotMode = oneShot;
+}
+
+void MCP2515Class::abortTxBuffer(int n)
+{
+  // Clearing TXREQ aborts a pending transmission of this buffer only, unlike
+  // ABAT. A transmission already in progress still completes.
+  modifyRegister(REG_TXBnCTRL(n), 0x08, 0x00);
+}
+
+int MCP2515Class::txOutcome(int n, uint8_t regCTRL, bool expired)
+{
+  if (readRegister(REG_CANINTF) & FLAG_TXnIF(n)) {
+    return CAN_TX_SENT;
+  }
+  if (expired) {
+    return CAN_TX_EXPIRED;
+  }
+  // MLOA (TXBnCTRL[5]) without a successful transmission only happens in
+  // one-shot mode, where arbitration is not retried.
+  if (regCTRL & 0x20) {
+    return CAN_TX_LOST_ARBITRATION;
+  }
+
+  return CAN_TX_ERROR;
+}
+
+int MCP2515Class::loadTxBuffer(int n, const CANFrame& frame)
+{
+  if (n < 0 || n > 2 || frame.dlc > 8) {
+    return 0;
+  }
 
   // Pre-calculate values for all registers so that we can write them
   // sequentially via the LOAD TX BUFFER instruction.
-  // TX BUFFER
   uint8_t regSIDH;
   uint8_t regSIDL;
   uint8_t regEID8;
   uint8_t regEID0;
-  if (_txExtended) {
-    regSIDH = _txId >> 21;
+  if (frame.extended) {
+    regSIDH = frame.id >> 21;
     regSIDL =
-        (((_txId >> 18) & 0x07) << 5) | FLAG_EXIDE | ((_txId >> 16) & 0x03);
-    regEID8 = (_txId >> 8) & 0xff;
-    regEID0 = _txId & 0xff;
+        (((frame.id >> 18) & 0x07) << 5) | FLAG_EXIDE | ((frame.id >> 16) & 0x03);
+    regEID8 = (frame.id >> 8) & 0xff;
+    regEID0 = frame.id & 0xff;
   } else {
-    regSIDH = _txId >> 3;
-    regSIDL = _txId << 5;
+    regSIDH = frame.id >> 3;
+    regSIDL = frame.id << 5;
     regEID8 = 0x00;
     regEID0 = 0x00;
   }
 
   uint8_t regDLC;
-  if (_txRtr) {
-    regDLC = 0x40 | _txLength;
+  if (frame.rtr) {
+    regDLC = 0x40 | frame.dlc;
   } else {
-    regDLC = _txLength;
+    regDLC = frame.dlc;
   }
 
-  _spi->beginTransaction(_spiSettings);
+  beginTransaction();
   digitalWrite(_csPin, LOW);
   // Send the LOAD TX BUFFER instruction to sequentially write registers,
   // starting from TXBnSIDH(n).
@@ -212,74 +583,170 @@ int MCP2515Class::endPacket()
   _spi->transfer(regEID8);
   _spi->transfer(regEID0);
   _spi->transfer(regDLC);
-  if (!_txRtr) {
-    for (uint8_t i = 0; i < _txLength; i++) {
-      _spi->transfer(_txData[i]);
+  if (!frame.rtr) {
+    for (uint8_t i = 0; i < frame.dlc; i++) {
+      _spi->transfer(frame.data[i]);
     }
   }
   digitalWrite(_csPin, HIGH);
-  _spi->endTransaction();
+  endTransaction();
 
-  _spi->beginTransaction(_spiSettings);
+  return 1;
+}
+
+void MCP2515Class::requestToSend(uint8_t buffers)
+{
+  beginTransaction();
   digitalWrite(_csPin, LOW);
   // Send the RTS instruction, which sets the TXREQ (TXBnCTRL[3]) bit for the
-  // respective buffer, and clears the ABTF, MLOA and TXERR bits.
-  _spi->transfer(0b10000000 | (1 << n));
+  // respective buffers, and clears the ABTF, MLOA and TXERR bits.
+  _spi->transfer(0b10000000 | (buffers & 0x07));
   digitalWrite(_csPin, HIGH);
-  _spi->endTransaction();
+  endTransaction();
+}
 
-  // Wait until the transmission completes, or gets aborted.
-  // Transmission is pending while TXREQ (TXBnCTRL[3]) bit is set.
-  bool aborted = false;
-  unsigned start_time_ms = millis();
-  while (readRegister(REG_TXBnCTRL(n)) & 0x08) {
-    // Read the TXERR (TXBnCTRL[4]) bit to check for errors.
-    if (readRegister(REG_TXBnCTRL(n)) & 0x10) {
-      // Abort on errors by setting the ABAT bit. The MCP2515 will should the
-      // TXREQ bit shortly. We'll keep running the loop until TXREQ is cleared.
-      modifyRegister(REG_CANCTRL, 0x10, 0x10);
-      aborted = true;
+uint8_t MCP2515Class::pendingTxBuffers()
+{
+  beginTransaction();
+  digitalWrite(_csPin, LOW);
+  _spi->transfer(0xa0);  // READ STATUS
+  uint8_t status = _spi->transfer(0x00);
+  digitalWrite(_csPin, HIGH);
+  endTransaction();
+
+  // TXREQ of TXB0, TXB1 and TXB2 are reported in bits 2, 4 and 6.
+  return ((status >> 2) & 0x01) | ((status >> 3) & 0x02) | ((status >> 4) & 0x04);
+}
+
+int MCP2515Class::setRequestToSendPins(uint8_t buffers)
+{
+  buffers &= 0x07;
+
+  if (_autoResponseCount && (buffers & (1 << MCP2515_AUTO_RESPONSE_TX_BUFFER))) {
+    return 0;
+  }
+
+  // Before begin(), which writes the pin setting, the SPI bus is not up yet.
+  if (!_configured) {
+    _reservedTxBuffers = (_reservedTxBuffers & ~_rtsPinBuffers) | buffers;
+    _rtsPinBuffers = buffers;
+    return 1;
+  }
+
+  // BnRTSM is bit n of TXRTSCTRL, and can only be changed in configuration
+  // mode.
+  if ((readRegister(REG_TXRTSCTRL) & 0x07) != buffers) {
+    uint8_t mode = readRegister(REG_CANSTAT) & MODE_MASK;
+    if (!switchToConfigurationMode()) {
+      return 0;
+    }
+    writeRegister(REG_TXRTSCTRL, buffers);
+    _pinControlShadow[1] = buffers;
+    if (!setMode(mode)) {
+      return 0;
     }
+  }
+
+  _reservedTxBuffers = (_reservedTxBuffers & ~_rtsPinBuffers) | buffers;
+  _rtsPinBuffers = buffers;
 
-    // Check for timeout
-    if (millis() - start_time_ms > _tx_response_timeout) {
-      // Abort on errors by setting the ABAT bit. The MCP2515 will should the
-      // TXREQ bit shortly. We'll keep running the loop until TXREQ is cleared.
-      modifyRegister(REG_CANCTRL, 0x10, 0x10);
-      aborted = true;
+  return 1;
+}
+
+int MCP2515Class::setAutoResponses(const CANAutoResponse* responses, uint8_t count)
+{
+  // The reply buffer is triggered by its TXnRTS pin instead.
+  if (_rtsPinBuffers & (1 << MCP2515_AUTO_RESPONSE_TX_BUFFER)) {
+    return (responses == NULL || count == 0) ? 1 : 0;
+  }
+
+  int n = MCP2515_AUTO_RESPONSE_TX_BUFFER;
+  bool enabled = (_autoResponseCount > 0);
+
+  _autoResponseCount = 0;
+  _armedAutoResponse = -1;
+  _reservedTxBuffers &= ~(1 << n);
+
+  if (responses == NULL || count == 0) {
+    // Back to the default priority, or frames from endPacket() that land in
+    // the buffer would keep overtaking the others.
+    if (enabled) {
+      modifyRegister(REG_TXBnCTRL(n), 0x03, 0x00);
     }
+    return 1;
+  }
 
-    yield();
+  if (pendingTxBuffers() & (1 << n)) {
+    return 0;
   }
 
-  if (aborted) {
-    // Reset the ABAT bit.
-    modifyRegister(REG_CANCTRL, 0x10, 0x00);
+  // Give the reply buffer the highest priority, so that replies overtake
+  // anything queued in the other buffers, and preload the first reply.
+  modifyRegister(REG_TXBnCTRL(n), 0x03, 0x03);
+  if (!loadTxBuffer(n, responses[0].response)) {
+    return 0;
   }
 
-  // Clear the pending TX interrupt, if any.
-  modifyRegister(REG_CANINTF, FLAG_TXnIF(n), 0x00);
+  _autoResponses = responses;
+  _autoResponseCount = count;
+  _armedAutoResponse = 0;
+  _reservedTxBuffers |= (1 << n);
 
-  // Report failure if either of the ABTF, MLOA or TXERR bits are set.
-  // TODO: perhaps we can reuse the last value read from this register // earlier?
-  return (readRegister(REG_TXBnCTRL(n)) & 0x70) ? 0 : 1;
+  return 1;
+}
+
+void MCP2515Class::autoRespond()
+{
+  for (uint8_t i = 0; i < _autoResponseCount; i++) {
+    const CANAutoResponse& entry = _autoResponses[i];
+
+    if (entry.requestId != _rxId || entry.requestExtended != _rxExtended ||
+        entry.requestRtr != _rxRtr) {
+      continue;
+    }
+    if (entry.matchLength > _rxLength ||
+        memcmp(entry.match, _rxData, entry.matchLength) != 0) {
+      continue;
+    }
+
+    // While the previous reply is still pending, the buffer can neither be
+    // reloaded nor sent again: an RTS would be a no-op.
+    int n = MCP2515_AUTO_RESPONSE_TX_BUFFER;
+    if (pendingTxBuffers() & (1 << n)) {
+      _autoResponsesMissed++;
+      return;
+    }
+
+    if (i != _armedAutoResponse) {
+      // A different reply than the preloaded one.
+      loadTxBuffer(n, entry.response);
+      _armedAutoResponse = i;
+    }
+
+    // The buffer keeps its contents after a transmission, so a repeated
+    // request for the armed reply costs a single RTS.
+    requestToSend(1 << n);
+    _autoResponsesSent++;
+    return;
+  }
 }
 
 int MCP2515Class::parsePacket()
 {
-  _spi->beginTransaction(_spiSettings);
-  digitalWrite(_csPin, LOW);
-  _spi->transfer(0xb0);  // RX STATUS
-  uint8_t rxStatus = _spi->transfer(0x00);
-  digitalWrite(_csPin, HIGH);
-  _spi->endTransaction();
+  // Frames consumed by the receive hooks (e.g. a mailbox) are skipped.
+  while (readPacket()) {
+    if (deliverPacket()) {
+      return _rxDlc;
+    }
+  }
 
-  int n;
-  if (rxStatus & 0x40) {
-    n = 0;
-  } else if (rxStatus & 0x80) {
-    n = 1;
-  } else {
+  return 0;
+}
+
+int MCP2515Class::readPacket()
+{
+  int n = fullRxBuffer();
+  if (n < 0) {
     _rxId = -1;
     _rxExtended = false;
     _rxRtr = false;
@@ -289,7 +756,7 @@ int MCP2515Class::parsePacket()
     return 0;
   }
 
-  _spi->beginTransaction(_spiSettings);
+  beginTransaction();
   digitalWrite(_csPin, LOW);
   // Send READ RX BUFFER instruction to sequentially read registers, starting
   // from RXBnSIDH(n).
@@ -334,8 +801,42 @@ int MCP2515Class::parsePacket()
   // Don't need to unset the RXnIF(n) flag as this is done automatically when
   // setting the CS high after a READ RX BUFFER instruction.
   digitalWrite(_csPin, HIGH);
-  _spi->endTransaction();
-  return _rxDlc;
+  endTransaction();
+
+  if (_autoResponseCount) {
+    autoRespond();
+  }
+
+  return 1;
+}
+
+int MCP2515Class::fullRxBuffer()
+{
+  // RXB0 first, as frames roll over from it into RXB1. RX1BF alone cannot be
+  // trusted: RXB0 may hold an older frame, which only RX STATUS tells.
+  if (_rx0bfPin >= 0) {
+    if (digitalRead(_rx0bfPin) == LOW) {
+      return 0;
+    }
+    if (_rx1bfPin >= 0) {
+      return (digitalRead(_rx1bfPin) == LOW) ? 1 : -1;
+    }
+  }
+
+  beginTransaction();
+  digitalWrite(_csPin, LOW);
+  _spi->transfer(0xb0);  // RX STATUS
+  uint8_t rxStatus = _spi->transfer(0x00);
+  digitalWrite(_csPin, HIGH);
+  endTransaction();
+
+  if (rxStatus & 0x40) {
+    return 0;
+  } else if (rxStatus & 0x80) {
+    return 1;
+  }
+
+  return -1;
 }
 
 void MCP2515Class::onReceive(void(*callback)(int))
@@ -349,7 +850,11 @@ void MCP2515Class::onReceive(void(*callback)(int))
 // something as appropriate.
 #ifndef ARDUINO_ARCH_ESP32
   if (callback) {
-    _spi->usingInterrupt(digitalPinToInterrupt(_intPin));
+    // With a CANSPIBus, handleInterrupt() checks for other users of the bus
+    // itself.
+    if (!_spiBus) {
+      _spi->usingInterrupt(digitalPinToInterrupt(_intPin));
+    }
     attachInterrupt(digitalPinToInterrupt(_intPin), MCP2515Class::onInterrupt, LOW);
   } else {
     detachInterrupt(digitalPinToInterrupt(_intPin));
@@ -360,48 +865,31 @@ void MCP2515Class::onReceive(void(*callback)(int))
 #endif
 }
 
+void MCP2515Class::setReceivePolling(unsigned long quietMicros, uint8_t weight)
+{
+  _rxPollQuietMicros = quietMicros;
+  _rxPollWeight = weight ? weight : 1;
+}
+
 int MCP2515Class::filter(int id, int mask)
 {
   id &= 0x7ff;
   mask &= 0x7ff;
 
-  // config mode
-  writeRegister(REG_CANCTRL, 0x80);
-  // TODO: The requested mode must be verified by reading the OPMODE[2:0] bits (CANSTAT[7:5])
-  if (readRegister(REG_CANCTRL) != 0x80) {
-    return 0;
-  }
-
+  uint8_t masks[8];
+  uint8_t filters[24];
   for (int n = 0; n < 2; n++) {
-    // standard only
-    // TODO: This doesn't look correct. According to the datasheet, the RXM0 and
-    // RMX1 should either both be unset (in which case filters are active), or
-    // both be unset (in which case all filters are ignored).
-    // Either way, it's unclear why we write to the same register twice here.
-    writeRegister(REG_RXBnCTRL(n), FLAG_RXM0);
-    writeRegister(REG_RXBnCTRL(n), FLAG_RXM0);
-
-    writeRegister(REG_RXMnSIDH(n), mask >> 3);
-    writeRegister(REG_RXMnSIDL(n), mask << 5);
-    writeRegister(REG_RXMnEID8(n), 0);
-    writeRegister(REG_RXMnEID0(n), 0);
+    encodeStandardId(mask, &masks[n * 4]);
   }
-
   for (int n = 0; n < 6; n++) {
-    writeRegister(REG_RXFnSIDH(n), id >> 3);
-    writeRegister(REG_RXFnSIDL(n), id << 5);
-    writeRegister(REG_RXFnEID8(n), 0);
-    writeRegister(REG_RXFnEID0(n), 0);
+    encodeStandardId(id, &filters[n * 4]);
   }
 
-  // normal mode
-  writeRegister(REG_CANCTRL, 0x00);
-  // TODO: The requested mode must be verified by reading the OPMODE[2:0] bits (CANSTAT[7:5])
-  if (readRegister(REG_CANCTRL) != 0x00) {
-    return 0;
-  }
-
-  return 1;
+  // standard only
+  // TODO: This doesn't look correct. According to the datasheet, the RXM0 and
+  // RMX1 should either both be unset (in which case filters are active), or
+  // both be unset (in which case all filters are ignored).
+  return updateAcceptanceFilters(masks, filters, FLAG_RXM0, FLAG_RXM0) ? 1 : 0;
 }
 
 boolean MCP2515Class::setFilterRegisters(
@@ -409,44 +897,20 @@ boolean MCP2515Class::setFilterRegisters(
     uint16_t mask1, uint16_t filter2, uint16_t filter3, uint16_t filter4, uint16_t filter5,
     bool allowRollover)
 {
-  mask0 &= 0x7ff;
-  filter0 &= 0x7ff;
-  filter1 &= 0x7ff;
-  mask1 &= 0x7ff;
-  filter2 &= 0x7ff;
-  filter3 &= 0x7ff;
-  filter4 &= 0x7ff;
-  filter5 &= 0x7ff;
-
-  if (!switchToConfigurationMode()) {
-    return false;
-  }
+  const uint16_t maskArray[2] = {mask0, mask1};
+  const uint16_t filterArray[6] =
+      {filter0, filter1, filter2, filter3, filter4, filter5};
 
-  writeRegister(REG_RXBnCTRL(0), allowRollover ? FLAG_RXB0CTRL_BUKT : 0);
-  writeRegister(REG_RXBnCTRL(1), 0);
+  uint8_t masks[8];
+  uint8_t filters[24];
   for (int n = 0; n < 2; n++) {
-    uint8_t mask = (n == 0) ? mask0 : mask1;
-    writeRegister(REG_RXMnSIDH(n), mask >> 3);
-    writeRegister(REG_RXMnSIDL(n), mask << 5);
-    writeRegister(REG_RXMnEID8(n), 0);
-    writeRegister(REG_RXMnEID0(n), 0);
+    encodeStandardId(maskArray[n] & 0x7ff, &masks[n * 4]);
   }
-
-  uint8_t filter_array[6] =
-      {filter0, filter1, filter2, filter3, filter4, filter5};
   for (int n = 0; n < 6; n++) {
-    uint8_t id = filter_array[n];
-    writeRegister(REG_RXFnSIDH(n), id >> 3);
-    writeRegister(REG_RXFnSIDL(n), id << 5);
-    writeRegister(REG_RXFnEID8(n), 0);
-    writeRegister(REG_RXFnEID0(n), 0);
-  }
-
-  if (!switchToNormalMode()) {
-    return false;
+    encodeStandardId(filterArray[n] & 0x7ff, &filters[n * 4]);
   }
 
-  return true;
+  return updateAcceptanceFilters(masks, filters, allowRollover ? FLAG_RXB0CTRL_BUKT : 0, 0);
 }
 
 int MCP2515Class::filterExtended(long id, long mask)
@@ -454,101 +918,191 @@ int MCP2515Class::filterExtended(long id, long mask)
   id &= 0x1FFFFFFF;
   mask &= 0x1FFFFFFF;
 
-  // config mode
-  writeRegister(REG_CANCTRL, 0x80);
-  // TODO: The requested mode must be verified by reading the OPMODE[2:0] bits (CANSTAT[7:5])
-  if (readRegister(REG_CANCTRL) != 0x80) {
-    return 0;
+  uint8_t masks[8];
+  uint8_t filters[24];
+  for (int n = 0; n < 2; n++) {
+    encodeExtendedId(mask, &masks[n * 4]);
+  }
+  for (int n = 0; n < 6; n++) {
+    encodeExtendedId(id, &filters[n * 4]);
   }
 
-  for (int n = 0; n < 2; n++) {
-    // extended only
-    // TODO: This doesn't look correct. According to the datasheet, the RXM0 and
-    // RMX1 should either both be unset (in which case filters are active), or
-    // both be unset (in which case all filters are ignored).
-    // Either way, it's unclear why we write to the same register twice here.
-    writeRegister(REG_RXBnCTRL(n), FLAG_RXM1);
-    writeRegister(REG_RXBnCTRL(n), FLAG_RXM1);
+  // extended only
+  // TODO: See filter().
+  return updateAcceptanceFilters(masks, filters, FLAG_RXM1, FLAG_RXM1) ? 1 : 0;
+}
 
-    writeRegister(REG_RXMnSIDH(n), mask >> 21);
-    writeRegister(REG_RXMnSIDL(n), (((mask >> 18) & 0x03) << 5) | FLAG_EXIDE | ((mask >> 16) & 0x03));
-    writeRegister(REG_RXMnEID8(n), (mask >> 8) & 0xff);
-    writeRegister(REG_RXMnEID0(n), mask & 0xff);
+bool MCP2515Class::updateAcceptanceFilters(const uint8_t* masks, const uint8_t* filters,
+    uint8_t regRXB0CTRL, uint8_t regRXB1CTRL)
+{
+  // Frames arriving while in configuration mode are lost, so it is only
+  // entered if a filter or mask actually changes, and left again after at
+  // most three burst writes.
+  if (!_acceptanceShadowValid ||
+      memcmp(filters, _filterShadow, sizeof(_filterShadow)) != 0 ||
+      memcmp(masks, _maskShadow, sizeof(_maskShadow)) != 0) {
+    uint8_t mode = readRegister(REG_CANSTAT) & MODE_MASK;
+    if (!switchToConfigurationMode()) {
+      return false;
+    }
+
+    // RXF0-2, RXF3-5 and RXM0-1 are three separate runs of registers.
+    writeChangedRegisters(REG_RXFnSIDH(0), filters, _filterShadow, 12);
+    writeChangedRegisters(REG_RXFnSIDH(3), filters + 12, _filterShadow + 12, 12);
+    writeChangedRegisters(REG_RXMnSIDH(0), masks, _maskShadow, 8);
+    _acceptanceShadowValid = true;
+
+    // Back to the mode we came from, e.g. configuration mode after
+    // begin(baudRate, true).
+    if (!setMode(mode)) {
+      return false;
+    }
   }
 
-  for (int n = 0; n < 6; n++) {
-    writeRegister(REG_RXFnSIDH(n), id >> 21);
-    writeRegister(REG_RXFnSIDL(n), (((id >> 18) & 0x03) << 5) | FLAG_EXIDE | ((id >> 16) & 0x03));
-    writeRegister(REG_RXFnEID8(n), (id >> 8) & 0xff);
-    writeRegister(REG_RXFnEID0(n), id & 0xff);
+  // RXBnCTRL can be written in any mode.
+  const uint8_t regRXBnCTRL[2] = {regRXB0CTRL, regRXB1CTRL};
+  for (int n = 0; n < 2; n++) {
+    if (regRXBnCTRL[n] != _rxbCtrlShadow[n]) {
+      writeRegister(REG_RXBnCTRL(n), regRXBnCTRL[n]);
+      _rxbCtrlShadow[n] = regRXBnCTRL[n];
+    }
   }
 
-  // normal mode
-  writeRegister(REG_CANCTRL, 0x00);
-  // TODO: The requested mode must be verified by reading the OPMODE[2:0] bits (CANSTAT[7:5])
-  if (readRegister(REG_CANCTRL) != 0x00) {
-    return 0;
+  return true;
+}
+
+void MCP2515Class::writeChangedRegisters(uint8_t address, const uint8_t* values, uint8_t* shadow, uint8_t count)
+{
+  uint8_t first = 0;
+  uint8_t last = count - 1;
+
+  if (_acceptanceShadowValid) {
+    while (first < count && values[first] == shadow[first]) {
+      first++;
+    }
+    if (first == count) {
+      return;
+    }
+    while (values[last] == shadow[last]) {
+      last--;
+    }
   }
 
-  return 1;
+  // Unchanged registers in between are rewritten rather than split into
+  // several transactions.
+  writeRegisters(address + first, values + first, last - first + 1);
+  memcpy(shadow + first, values + first, last - first + 1);
 }
 
-bool MCP2515Class::switchToNormalMode() {
-  // TODO: Should we use modifyRegister(REG_CANCTRL, 0xe0, 0x00) here instead?
-  writeRegister(REG_CANCTRL, 0x00);
-  return (readRegister(REG_CANCTRL) & 0xe0) == 0x00;
+void MCP2515Class::encodeStandardId(uint16_t id, uint8_t* regs)
+{
+  regs[0] = id >> 3;
+  regs[1] = id << 5;
+  regs[2] = 0;
+  regs[3] = 0;
+}
+
+void MCP2515Class::encodeExtendedId(long id, uint8_t* regs)
+{
+  regs[0] = id >> 21;
+  regs[1] = (((id >> 18) & 0x07) << 5) | FLAG_EXIDE | ((id >> 16) & 0x03);
+  regs[2] = (id >> 8) & 0xff;
+  regs[3] = id & 0xff;
+}
+
+bool MCP2515Class::switchToNormalMode()
+{
+  return setMode(MODE_NORMAL);
 }
 
 bool MCP2515Class::switchToConfigurationMode()
 {
-  // TODO: Should we use modifyRegister(REG_CANCTRL, 0xe0, 0x80) here instead?
-  writeRegister(REG_CANCTRL, 0x80);
-  return (readRegister(REG_CANCTRL) & 0xe0) == 0x80;
+  return setMode(MODE_CONFIGURATION);
 }
 
 int MCP2515Class::observe()
 {
-  // TODO: These should probably be 0x60, not 0x80.
-  writeRegister(REG_CANCTRL, 0x80);
-  // TODO: The requested mode must be verified by reading the OPMODE[2:0] bits (CANSTAT[7:5])
-  if (readRegister(REG_CANCTRL) != 0x80) {
-    return 0;
-  }
-
-  return 1;
+  return setMode(MODE_LISTEN_ONLY) ? 1 : 0;
 }
 
 int MCP2515Class::loopback()
 {
-  writeRegister(REG_CANCTRL, 0x40);
-  // TODO: The requested mode must be verified by reading the OPMODE[2:0] bits (CANSTAT[7:5])
-  if (readRegister(REG_CANCTRL) != 0x40) {
-    return 0;
+  return setMode(MODE_LOOPBACK) ? 1 : 0;
+}
+
+int MCP2515Class::sleep()
+{
+  return setMode(MODE_SLEEP) ? 1 : 0;
+}
+
+int MCP2515Class::wakeup()
+{
+  // Sleep mode is only left through a wake-up, caused by bus activity or by
+  // setting WAKIF. The controller then comes up in listen-only mode.
+  if ((readRegister(REG_CANSTAT) & MODE_MASK) == MODE_SLEEP) {
+    wakeFromSleep();
   }
 
-  return 1;
+  return setMode(MODE_NORMAL) ? 1 : 0;
 }
 
-int MCP2515Class::sleep()
+int MCP2515Class::resume()
 {
-  writeRegister(REG_CANCTRL, 0x01);
-  // TODO: The requested mode must be verified by reading the OPMODE[2:0] bits (CANSTAT[7:5])
-  if (readRegister(REG_CANCTRL) != 0x01) {
+  if (!_configured) {
     return 0;
   }
 
-  return 1;
+  // The SPI peripheral may have been powered down with the MCU.
+  pinMode(_csPin, OUTPUT);
+  _spi->begin();
+
+  uint8_t mode = readRegister(REG_CANSTAT) & MODE_MASK;
+  if (mode == MODE_SLEEP) {
+    wakeFromSleep();
+    // The controller wakes up in listen-only mode.
+    if (!setMode(MODE_LISTEN_ONLY)) {
+      return 0;
+    }
+  } else if (readRegister(REG_CANINTF) & FLAG_WAKIF) {
+    // Woken up by bus activity.
+    _wakeUps++;
+  }
+
+  if (!restoreConfiguration()) {
+    return 0;
+  }
+
+  bool ok = switchToNormalMode();
+  modifyRegister(REG_CANINTF, FLAG_WAKIF, 0x00);
+
+  return ok ? 1 : 0;
 }
 
-int MCP2515Class::wakeup()
+int MCP2515Class::setWakeOnCAN(bool enable)
 {
-  writeRegister(REG_CANCTRL, 0x00);
-  // TODO: The requested mode must be verified by reading the OPMODE[2:0] bits (CANSTAT[7:5])
-  if (readRegister(REG_CANCTRL) != 0x00) {
+  _wakeOnCAN = enable;
+
+  if (!_configured) {
+    return 1;
+  }
+
+  if (enable) {
+    _controlShadow[0] |= FLAG_CNF3_WAKFIL;
+    _controlShadow[3] |= FLAG_WAKIE;
+  } else {
+    _controlShadow[0] &= ~FLAG_CNF3_WAKFIL;
+    _controlShadow[3] &= ~FLAG_WAKIE;
+  }
+
+  // CNF3 can only be written in configuration mode.
+  uint8_t mode = readRegister(REG_CANSTAT) & MODE_MASK;
+  if (!switchToConfigurationMode()) {
     return 0;
   }
+  writeRegister(REG_CNF3, _controlShadow[0]);
+  writeRegister(REG_CANINTE, _controlShadow[3]);
 
-  return 1;
+  return setMode(mode) ? 1 : 0;
 }
 
 void MCP2515Class::setPins(int cs, int irq)
@@ -557,6 +1111,20 @@ void MCP2515Class::setPins(int cs, int irq)
   _intPin = irq;
 }
 
+void MCP2515Class::setSPIBus(CANSPIBus* bus)
+{
+  _spiBus = bus;
+  if (bus) {
+    bus->_can = this;
+  }
+}
+
+void MCP2515Class::setBufferFullPins(int rx0bf, int rx1bf)
+{
+  _rx0bfPin = rx0bf;
+  _rx1bfPin = rx1bf;
+}
+
 void MCP2515Class::setSPIFrequency(uint32_t frequency)
 {
   _spiSettings = SPISettings(frequency, MSBFIRST, SPI_MODE0);
@@ -657,14 +1225,138 @@ void MCP2515Class::dumpRegisters(Stream& out)
   }
 }
 
+// Only the bits of `actual` in `mask` are compared; the others are read-only
+// or unimplemented.
+static void compareBits(uint8_t& actual, uint8_t expected, uint8_t mask)
+{
+  actual = (actual & mask) | (expected & ~mask);
+}
+
+bool MCP2515Class::restoreConfiguration()
+{
+  uint8_t control[4];
+  uint8_t pinControl[2];
+  uint8_t rxbCtrl[2];
+  readRegisters(REG_CNF3, control, 4);
+  readRegisters(REG_BFPCTRL, pinControl, 2);
+  rxbCtrl[0] = readRegister(REG_RXBnCTRL(0));
+  rxbCtrl[1] = readRegister(REG_RXBnCTRL(1));
+  compareBits(control[0], _controlShadow[0], 0xc7);
+  compareBits(pinControl[0], _pinControlShadow[0], 0x0f);
+  compareBits(pinControl[1], _pinControlShadow[1], 0x07);
+  compareBits(rxbCtrl[0], _rxbCtrlShadow[0], FLAG_RXM1 | FLAG_RXM0 | FLAG_RXB0CTRL_BUKT);
+  compareBits(rxbCtrl[1], _rxbCtrlShadow[1], FLAG_RXM1 | FLAG_RXM0);
+
+  // Filters and masks are only known once set after begin().
+  uint8_t filters[24];
+  uint8_t masks[8];
+  bool acceptanceChanged = false;
+  if (_acceptanceShadowValid) {
+    readRegisters(REG_RXFnSIDH(0), filters, 12);
+    readRegisters(REG_RXFnSIDH(3), filters + 12, 12);
+    readRegisters(REG_RXMnSIDH(0), masks, 8);
+    for (int n = 0; n < 2; n++) {
+      compareBits(masks[n * 4 + 1], _maskShadow[n * 4 + 1], (uint8_t)~FLAG_EXIDE);
+    }
+    acceptanceChanged =
+        memcmp(filters, _filterShadow, sizeof(_filterShadow)) != 0 ||
+        memcmp(masks, _maskShadow, sizeof(_maskShadow)) != 0;
+  }
+
+  // CNF1-3, TXRTSCTRL, filters and masks can only be written in configuration
+  // mode, which is only entered if one of them needs it.
+  bool configure = acceptanceChanged ||
+      memcmp(control, _controlShadow, 3) != 0 ||
+      pinControl[1] != _pinControlShadow[1];
+  uint8_t mode = 0;
+  if (configure) {
+    mode = readRegister(REG_CANSTAT) & MODE_MASK;
+    if (!switchToConfigurationMode()) {
+      return false;
+    }
+  }
+
+  uint8_t repairs = 0;
+  repairs += repairRegisters(REG_CNF3, _controlShadow, control, 4);
+  repairs += repairRegisters(REG_BFPCTRL, _pinControlShadow, pinControl, 2);
+  for (int n = 0; n < 2; n++) {
+    repairs += repairRegisters(REG_RXBnCTRL(n), &_rxbCtrlShadow[n], &rxbCtrl[n], 1);
+  }
+  if (acceptanceChanged) {
+    repairs += repairRegisters(REG_RXFnSIDH(0), _filterShadow, filters, 12);
+    repairs += repairRegisters(REG_RXFnSIDH(3), _filterShadow + 12, filters + 12, 12);
+    repairs += repairRegisters(REG_RXMnSIDH(0), _maskShadow, masks, 8);
+  }
+  _configurationRepairs += repairs;
+
+  if (configure && !setMode(mode)) {
+    return false;
+  }
+
+  // If the configuration was lost, so was the preloaded auto-response.
+  if (repairs && _autoResponseCount && !setAutoResponses(_autoResponses, _autoResponseCount)) {
+    return false;
+  }
+
+  return true;
+}
+
+uint8_t MCP2515Class::repairRegisters(uint8_t address, const uint8_t* expected, const uint8_t* actual, uint8_t count)
+{
+  uint8_t first = 0;
+  while (first < count && expected[first] == actual[first]) {
+    first++;
+  }
+  if (first == count) {
+    return 0;
+  }
+
+  uint8_t last = count - 1;
+  while (expected[last] == actual[last]) {
+    last--;
+  }
+
+  uint8_t repairs = 0;
+  for (uint8_t i = first; i <= last; i++) {
+    if (expected[i] != actual[i]) {
+      repairs++;
+    }
+  }
+
+  writeRegisters(address + first, expected + first, last - first + 1);
+
+  return repairs;
+}
+
+bool MCP2515Class::setMode(uint8_t mode)
+{
+  // Only REQOP is changed; CANCTRL also holds OSM and the CLKOUT settings.
+  modifyRegister(REG_CANCTRL, MODE_MASK, mode);
+
+  // The request is done once OPMODE reports the new mode.
+  unsigned long start = millis();
+  while ((readRegister(REG_CANSTAT) & MODE_MASK) != mode) {
+    if (millis() - start > MODE_CHANGE_TIMEOUT_MILLIS) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
 void MCP2515Class::reset()
 {
-  _spi->beginTransaction(_spiSettings);
+  beginTransaction();
   digitalWrite(_csPin, LOW);
   _spi->transfer(0xc0);
   digitalWrite(_csPin, HIGH);
-  _spi->endTransaction();
+  endTransaction();
 
+  waitForOscillator();
+}
+
+void MCP2515Class::waitForOscillator()
+{
   // From the data sheet:
   // The OST keeps the device in a Reset state for 128 OSC1 clock cycles after
   // the occurrence of a Power-on Reset, SPI Reset, after the assertion of the
@@ -676,14 +1368,131 @@ void MCP2515Class::reset()
   delayMicroseconds(ceil(160 * 1000000.0 / _clockFrequency));
 }
 
+void MCP2515Class::wakeFromSleep()
+{
+  // Setting WAKIF only wakes the controller up while WAKIE is set, which is
+  // not the case without wake-on-CAN. WAKIE is enabled alone meanwhile, as
+  // Linux' mcp251x driver does.
+  writeRegister(REG_CANINTE, FLAG_WAKIE);
+  modifyRegister(REG_CANINTF, FLAG_WAKIF, FLAG_WAKIF);
+  waitForOscillator();
+  modifyRegister(REG_CANINTF, FLAG_WAKIF, 0x00);
+  writeRegister(REG_CANINTE, _controlShadow[3]);
+}
+
 void MCP2515Class::handleInterrupt()
 {
-  if (readRegister(REG_CANINTF) == 0) {
+  // Another device is in the middle of a transfer: the drain runs when it
+  // releases the bus. Until then, the level-triggered interrupt must stay
+  // off, or it would fire again right away.
+  if (_spiBus && _spiBus->defer()) {
+#ifndef ARDUINO_ARCH_ESP32
+    detachInterrupt(digitalPinToInterrupt(_intPin));
+#endif
+    return;
+  }
+
+  uint8_t regCANINTF = readRegister(REG_CANINTF);
+  if (regCANINTF == 0) {
+    return;
+  }
+
+  // Woken up by CAN traffic, see setWakeOnCAN(). The controller is in
+  // listen-only mode and takes part in the bus again once the current frame
+  // is over; no need to wait for it here.
+  if (regCANINTF & FLAG_WAKIF) {
+    modifyRegister(REG_CANINTF, FLAG_WAKIF, 0x00);
+    modifyRegister(REG_CANCTRL, MODE_MASK, MODE_NORMAL);
+    _wakeUps++;
+  }
+
+  // ERRIF has to be cleared here, or the level-triggered interrupt would keep
+  // firing.
+  if (regCANINTF & FLAG_ERRIF) {
+    updateErrorState();
+  }
+
+  bool received = (regCANINTF & (FLAG_RXnIF(1) | FLAG_RXnIF(0)));
+  if (received) {
+    _rxInterrupts++;
+  }
+
+  // Only wait for more frames when one came in, not on error or wake-up
+  // interrupts alone.
+  if (_rxPollQuietMicros) {
+    if (received) {
+      pollReceive();
+    }
     return;
   }
 
+  // parsePacket() runs the per-ID handlers; only the remaining frames reach
+  // the callback.
   while (parsePacket()) {
-    _onReceive(available());
+    if (_onReceive) {
+      _onReceive(available());
+    }
+  }
+}
+
+void MCP2515Class::runDeferredInterrupt()
+{
+  handleInterrupt();
+
+#ifndef ARDUINO_ARCH_ESP32
+  if (_onReceive) {
+    attachInterrupt(digitalPinToInterrupt(_intPin), MCP2515Class::onInterrupt, LOW);
+  }
+#endif
+}
+
+void MCP2515Class::pollReceive()
+{
+  // With the RX interrupts masked, INT stays high while the buffers are
+  // drained. RXnIF are still set on receive, and polled by readPacket().
+  modifyRegister(REG_CANINTE, FLAG_RXnIE(1) | FLAG_RXnIE(0), 0x00);
+
+  uint8_t frames = 0;
+  unsigned long lastFrameMicros = micros();
+  while (frames < _rxPollWeight && micros() - lastFrameMicros < _rxPollQuietMicros) {
+    // Unlike parsePacket(), this counts frames with no data and frames taken
+    // by the receive hooks.
+    if (!readPacket()) {
+      continue;
+    }
+
+    frames++;
+    lastFrameMicros = micros();
+
+    if (deliverPacket() && _onReceive) {
+      _onReceive(available());
+    }
+  }
+
+  // The first frame came with the interrupt.
+  if (frames > 1) {
+    _rxPolledFrames += frames - 1;
+  }
+
+  // A frame received in the meantime pulls INT low again as soon as the RX
+  // interrupts are unmasked, so none is missed.
+  modifyRegister(REG_CANINTE, FLAG_RXnIE(1) | FLAG_RXnIE(0), FLAG_RXnIE(1) | FLAG_RXnIE(0));
+}
+
+void MCP2515Class::beginTransaction()
+{
+  if (_spiBus) {
+    _spiBus->acquire();
+  }
+  _spi->beginTransaction(_spiSettings);
+}
+
+void MCP2515Class::endTransaction()
+{
+  _spi->endTransaction();
+  // May run a drain deferred by an interrupt during the transaction.
+  if (_spiBus) {
+    _spiBus->release();
   }
 }
 
@@ -691,38 +1500,67 @@ uint8_t MCP2515Class::readRegister(uint8_t address)
 {
   uint8_t value;
 
-  _spi->beginTransaction(_spiSettings);
+  beginTransaction();
   digitalWrite(_csPin, LOW);
   _spi->transfer(0x03);
   _spi->transfer(address);
   value = _spi->transfer(0x00);
   digitalWrite(_csPin, HIGH);
-  _spi->endTransaction();
+  endTransaction();
 
   return value;
 }
 
+void MCP2515Class::readRegisters(uint8_t address, uint8_t* values, uint8_t count)
+{
+  // Like WRITE, READ increments the address after each byte.
+  beginTransaction();
+  digitalWrite(_csPin, LOW);
+  _spi->transfer(0x03);
+  _spi->transfer(address);
+  for (uint8_t i = 0; i < count; i++) {
+    values[i] = _spi->transfer(0x00);
+  }
+  digitalWrite(_csPin, HIGH);
+  endTransaction();
+}
+
 void MCP2515Class::modifyRegister(uint8_t address, uint8_t mask, uint8_t value)
 {
-  _spi->beginTransaction(_spiSettings);
+  beginTransaction();
   digitalWrite(_csPin, LOW);
   _spi->transfer(0x05);
   _spi->transfer(address);
   _spi->transfer(mask);
   _spi->transfer(value);
   digitalWrite(_csPin, HIGH);
-  _spi->endTransaction();
+  endTransaction();
 }
 
 void MCP2515Class::writeRegister(uint8_t address, uint8_t value)
 {
-  _spi->beginTransaction(_spiSettings);
+  beginTransaction();
   digitalWrite(_csPin, LOW);
   _spi->transfer(0x02);
   _spi->transfer(address);
   _spi->transfer(value);
   digitalWrite(_csPin, HIGH);
-  _spi->endTransaction();
+  endTransaction();
+}
+
+void MCP2515Class::writeRegisters(uint8_t address, const uint8_t* values, uint8_t count)
+{
+  // The WRITE instruction increments the address after each byte for as
+  // long as CS stays low.
+  beginTransaction();
+  digitalWrite(_csPin, LOW);
+  _spi->transfer(0x02);
+  _spi->transfer(address);
+  for (uint8_t i = 0; i < count; i++) {
+    _spi->transfer(values[i]);
+  }
+  digitalWrite(_csPin, HIGH);
+  endTransaction();
 }
 
 void MCP2515Class::onInterrupt()
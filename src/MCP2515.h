@@ -8,6 +8,8 @@
 
 #include "CANController.h"
 
+class CANSPIBus;
+
 #define MCP2515_DEFAULT_CLOCK_FREQUENCY 16e6
 
 #if defined(ARDUINO_ARCH_SAMD) && defined(PIN_SPI_MISO) && defined(PIN_SPI_MOSI) && defined(PIN_SPI_SCK) && (PIN_SPI_MISO == 10) && (PIN_SPI_MOSI == 8) && (PIN_SPI_SCK == 9)
@@ -22,6 +24,43 @@
 #define MCP2515_DEFAULT_INT_PIN         2
 #endif
 
+// Flags for endPacket(timeoutMicros, flags).
+// Send the frame once; it is not retransmitted after lost arbitration or
+// errors. This sets the chip-wide OSM bit, which also applies to frames
+// still pending in the other TX buffers.
+#define CAN_TX_ONE_SHOT            0x01
+// Return right after queueing the frame; its outcome is reported through
+// pollTransmit() and onTransmit().
+#define CAN_TX_NO_WAIT             0x02
+
+// Outcomes of a transmission.
+#define CAN_TX_SENT                1
+#define CAN_TX_PENDING             2
+#define CAN_TX_LOST_ARBITRATION    3
+#define CAN_TX_ERROR               4
+#define CAN_TX_EXPIRED             5
+
+// Default for the most frames drained per interrupt in polling receive mode,
+// after which the interrupt is re-armed so that loop() gets to run.
+#ifndef MCP2515_RX_POLL_WEIGHT
+#define MCP2515_RX_POLL_WEIGHT     16
+#endif
+
+// The TX buffer reserved for auto-responses while they are enabled.
+#define MCP2515_AUTO_RESPONSE_TX_BUFFER 2
+
+// An entry of the auto-responder table: when a frame with `requestId` (and
+// whose first `matchLength` data bytes equal `match`) is received, `response`
+// is sent immediately from the receive path.
+struct CANAutoResponse {
+  long requestId;
+  bool requestExtended;
+  bool requestRtr;
+  uint8_t matchLength;
+  uint8_t match[8];
+  CANFrame response;
+};
+
 class MCP2515Class : public CANControllerClass {
 
 public:
@@ -36,11 +75,91 @@ public:
   virtual void end();
 
   virtual int endPacket();
+  // Sends the packet with a per-frame policy: if it has not been sent within
+  // `timeoutMicros` of queueing (0 means the setTxTimeout() value), it is
+  // aborted from its TX buffer, leaving the other buffers alone. `flags` is a combination
+  // of CAN_TX_ONE_SHOT and CAN_TX_NO_WAIT. Returns one of the CAN_TX_*
+  // outcomes, CAN_TX_PENDING with CAN_TX_NO_WAIT, or 0 if the packet could not
+  // be queued.
+  int endPacket(unsigned long timeoutMicros, uint8_t flags);
+
+  // Checks frames sent with CAN_TX_NO_WAIT: aborts the ones past their
+  // timeout and reports completed ones to the onTransmit() callback. Call
+  // from loop(). Returns the number of frames completed.
+  int pollTransmit();
+  void onTransmit(void(*callback)(long id, int outcome));
+
+  // Low-level access to the three TX buffers, for sending several frames
+  // without waiting for each one. `buffers` and the return value of
+  // pendingTxBuffers() are bitmasks, bit n standing for TXBn. With equal
+  // priorities, higher numbered buffers are transmitted first.
+  int loadTxBuffer(int n, const CANFrame& frame);
+  void requestToSend(uint8_t buffers);
+  uint8_t pendingTxBuffers();
+  // Buffers in use by the driver itself (e.g. for auto-responses), which must
+  // not be loaded through loadTxBuffer().
+  uint8_t reservedTxBuffers() const { return _reservedTxBuffers; }
+
+  // Turns the TXnRTS pins of `buffers` (a bitmask, as above) into request-to-
+  // send inputs: a falling edge on TXnRTS starts the transmission of TXBn
+  // without any SPI traffic, e.g. from a timer compare output. Preload the
+  // frames with loadTxBuffer(); they stay in the buffers after being sent,
+  // so each further edge sends them again. endPacket() no longer uses these
+  // buffers. Fails if TXB2 is requested while auto-responses are enabled.
+  // Kept across begin(); pass 0 to disable.
+  int setRequestToSendPins(uint8_t buffers);
+  uint8_t requestToSendPins() const { return _rtsPinBuffers; }
+
+  // Answers requests straight from parsePacket(), and thus from the receive
+  // interrupt when onReceive() is used, without waiting for loop(). TX buffer
+  // MCP2515_AUTO_RESPONSE_TX_BUFFER is reserved for the replies and holds the
+  // last one sent (initially the first entry), which is then triggered with a
+  // single RTS instruction. The table is not copied and must stay valid;
+  // pass NULL to disable.
+  int setAutoResponses(const CANAutoResponse* responses, uint8_t count);
+  unsigned long autoResponsesSent() const { return _autoResponsesSent; }
+  // Replies that could not be sent because the previous one was still pending.
+  unsigned long autoResponsesMissed() const { return _autoResponsesMissed; }
 
   virtual int parsePacket();
 
+  using CANControllerClass::onReceive;
   virtual void onReceive(void(*callback)(int));
 
+  // Hybrid interrupt/polling receive for the onReceive() callback: the first
+  // frame of a burst raises the interrupt as usual, which then masks the RX
+  // interrupts and polls for further frames until none has arrived for
+  // `quietMicros`, or `weight` frames were read. This saves the interrupt
+  // entry and CANINTF read of every frame under load. Keep `quietMicros`
+  // around one or two frame times: the interrupt handler busy-waits for it
+  // after the last frame. 0 disables (default).
+  void setReceivePolling(unsigned long quietMicros, uint8_t weight = MCP2515_RX_POLL_WEIGHT);
+  // Receive interrupts taken, and frames read by polling within them.
+  unsigned long receiveInterrupts() const { return _rxInterrupts; }
+  unsigned long polledFrames() const { return _rxPolledFrames; }
+
+  // Error supervision. Transitions are picked up from the ERRIF interrupt
+  // when onReceive() is used, after failed transmissions, and by
+  // pollErrors(), which should be called from loop() otherwise. While bus-off,
+  // endPacket() fails immediately.
+  int pollErrors();
+  virtual int errorState() const { return _errorState; }
+  // Number of times each error state was entered.
+  unsigned long errorStateCount(int state) const { return _errorStateCounts[state & 0x03]; }
+  // Frames lost because both RX buffers were full.
+  virtual unsigned long rxOverflows() const { return _rxOverflows; }
+  int transmitErrorCount();
+  int receiveErrorCount();
+  // Called on each error state transition; may run from the interrupt.
+  void onErrorStateChange(void(*callback)(int state, int previousState));
+  // Re-initializes the controller through configuration mode `delayMillis`
+  // after it went bus-off, rather than only relying on the MCP2515's own
+  // recovery (128 x 11 recessive bits). Checked by pollErrors(). The delay
+  // doubles after each unsuccessful attempt, up to `maxDelayMillis`. 0
+  // disables (default).
+  void setBusOffRecovery(unsigned long delayMillis, unsigned long maxDelayMillis);
+  unsigned long busOffRecoveries() const { return _busOffRecoveries; }
+
   using CANControllerClass::filter;
   virtual int filter(int id, int mask);
 
@@ -65,8 +184,34 @@ public:
   virtual int loopback();
   virtual int sleep();
   virtual int wakeup();
+  // Gets the controller ready to receive again after sleep() or after the
+  // MCU slept, without the reset and full re-initialization of begin(): the
+  // controller is woken up if needed, and the bit timing, interrupt enables,
+  // pin functions, RX modes and filters are read back and only the registers
+  // that differ from what the driver configured are rewritten. Ends in normal
+  // mode. Needs a successful begin() before.
+  int resume();
+  // Lets CAN traffic wake the controller from sleep() through WAKIF, with the
+  // wake-up filter on to ignore glitches. With onReceive(), the interrupt
+  // then switches it back to normal mode right away; otherwise, wake the MCU
+  // from the INT pin and call resume(). The frame that woke the controller
+  // is lost. Call while awake; kept across begin().
+  int setWakeOnCAN(bool enable);
+  unsigned long wakeUps() const { return _wakeUps; }
+  // Registers found changed and rewritten by resume().
+  unsigned long configurationRepairs() const { return _configurationRepairs; }
 
   void setPins(int cs = MCP2515_DEFAULT_CS_PIN, int irq = MCP2515_DEFAULT_INT_PIN);
+  // Shares the SPI bus with other devices that lock it through `bus`, see
+  // CANSPIBus. The receive interrupt then defers to them instead of relying
+  // on SPI.usingInterrupt(). Call before onReceive(); NULL to detach.
+  void setSPIBus(CANSPIBus* bus);
+  // Optional pins wired to RX0BF and RX1BF, which go low while the matching
+  // RX buffer holds a frame. The driver then reads them instead of sending an
+  // RX STATUS instruction before each frame. -1 means not wired (default).
+  // RX1BF alone does not save anything, as RXB0 has to be checked first.
+  // Call before begin().
+  void setBufferFullPins(int rx0bf, int rx1bf);
   void setSPIFrequency(uint32_t frequency);
   void setClockFrequency(long clockFrequency);
   void setTxTimeout(unsigned timeout);
@@ -75,23 +220,103 @@ public:
   void dumpRegisters(Stream& out);
 
 private:
+  friend class CANSPIBus;
+
   void reset();
+  void waitForOscillator();
+  void wakeFromSleep();
+  bool setMode(uint8_t mode);
+  bool restoreConfiguration();
+  uint8_t repairRegisters(uint8_t address, const uint8_t* expected, const uint8_t* actual, uint8_t count);
+
+  int readPacket();
+  int fullRxBuffer();
 
   void handleInterrupt();
+  void runDeferredInterrupt();
+  void pollReceive();
+  void autoRespond();
+
+  void updateErrorState();
 
+  void setOneShotMode(bool oneShot);
+  void abortTxBuffer(int n);
+  int txOutcome(int n, uint8_t regCTRL, bool expired);
+
+  bool updateAcceptanceFilters(const uint8_t* masks, const uint8_t* filters,
+      uint8_t regRXB0CTRL, uint8_t regRXB1CTRL);
+  void writeChangedRegisters(uint8_t address, const uint8_t* values, uint8_t* shadow, uint8_t count);
+  static void encodeStandardId(uint16_t id, uint8_t* regs);
+  static void encodeExtendedId(long id, uint8_t* regs);
+
+  void beginTransaction();
+  void endTransaction();
   uint8_t readRegister(uint8_t address);
+  void readRegisters(uint8_t address, uint8_t* values, uint8_t count);
   void modifyRegister(uint8_t address, uint8_t mask, uint8_t value);
   void writeRegister(uint8_t address, uint8_t value);
+  void writeRegisters(uint8_t address, const uint8_t* values, uint8_t count);
 
   static void onInterrupt();
 
 private:
   SPISettings _spiSettings;
   SPIClass* _spi;
+  CANSPIBus* _spiBus;
   int _csPin;
   int _intPin;
+  int _rx0bfPin;
+  int _rx1bfPin;
   long _clockFrequency;
   unsigned _tx_response_timeout;  // Time to response from MCP
+
+  uint8_t _reservedTxBuffers;
+  uint8_t _rtsPinBuffers;
+
+  const CANAutoResponse* _autoResponses;
+  uint8_t _autoResponseCount;
+  int _armedAutoResponse;
+  unsigned long _autoResponsesSent;
+  unsigned long _autoResponsesMissed;
+
+  void (*_onTransmit)(long, int);
+  bool _oneShotMode;
+  uint8_t _trackedTxBuffers;
+  uint8_t _expiredTxBuffers;
+  long _txIds[3];
+  unsigned long _txStartMicros[3];
+  unsigned long _txTimeoutMicros[3];
+
+  volatile int _errorState;
+  void (*_onErrorStateChange)(int, int);
+  unsigned long _errorStateCounts[4];
+  unsigned long _busOffMillis;
+  unsigned long _busOffRecoveryMinDelay;
+  unsigned long _busOffRecoveryMaxDelay;
+  unsigned long _busOffRecoveryDelay;
+  unsigned long _busOffRecoveries;
+  unsigned long _rxOverflows;
+
+  unsigned long _rxPollQuietMicros;
+  uint8_t _rxPollWeight;
+  unsigned long _rxInterrupts;
+  unsigned long _rxPolledFrames;
+
+  bool _configured;
+  bool _wakeOnCAN;
+  unsigned long _wakeUps;
+  unsigned long _configurationRepairs;
+  // Last values written to CNF3, CNF2, CNF1 and CANINTE, and to BFPCTRL and
+  // TXRTSCTRL, which resume() checks.
+  uint8_t _controlShadow[4];
+  uint8_t _pinControlShadow[2];
+
+  // Last values written to RXF0-5 (SIDH, SIDL, EID8, EID0 each), RXM0-1 and
+  // RXB0-1CTRL, so that filter changes only write what differs.
+  bool _acceptanceShadowValid;
+  uint8_t _filterShadow[24];
+  uint8_t _maskShadow[8];
+  uint8_t _rxbCtrlShadow[2];
 };
 
 extern MCP2515Class CAN;
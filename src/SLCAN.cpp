@@ -0,0 +1,373 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "SLCAN.h"
+
+#define SLCAN_OK                   '\r'
+#define SLCAN_ERROR                '\a'
+
+// Status flags of the F command.
+#define SLCAN_FLAG_ERROR_WARNING   0x04
+#define SLCAN_FLAG_DATA_OVERRUN    0x08
+#define SLCAN_FLAG_ERROR_PASSIVE   0x20
+#define SLCAN_FLAG_BUS_ERROR       0x80
+
+static const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+// Bitrates selected by the S0-S8 commands. S7 (800 kbit/s) is answered with
+// BELL, as the MCP2515 driver has no bit timing for it and O would fail.
+static const long SLCAN_BITRATES[] = {
+  (long)10E3, (long)20E3, (long)50E3, (long)100E3, (long)125E3,
+  (long)250E3, (long)500E3, 0, (long)1000E3,
+};
+
+SLCANAdapter::SLCANAdapter(CANControllerClass& can, Stream& serial) :
+  _can(&can),
+  _serial(&serial),
+  _open(false),
+  _listenOnly(false),
+  _timestamps(false),
+  _bitrate((long)500E3),
+  _acceptanceCode(0x00000000),
+  _acceptanceMask(0xffffffff),
+  _commandLength(0),
+  _commandOverflow(false),
+  _txLength(0),
+  _reportedOverflows(0)
+{
+}
+
+void SLCANAdapter::poll()
+{
+  while (_serial->available()) {
+    int c = _serial->read();
+    if (c < 0) {
+      break;
+    }
+
+    if (c == '\r') {
+      if (_commandOverflow) {
+        reply(false);
+      } else if (_commandLength > 0) {
+        processCommand(_command, _commandLength);
+      }
+      _commandLength = 0;
+      _commandOverflow = false;
+    } else if (c == '\n') {
+      // Some tools terminate commands with CR LF.
+    } else if (_commandLength < SLCAN_MAX_COMMAND_LENGTH) {
+      _command[_commandLength++] = c;
+    } else {
+      _commandOverflow = true;
+    }
+  }
+
+  if (_open) {
+    for (int i = 0; i < SLCAN_MAX_FRAMES_PER_POLL && _can->parsePacket(); i++) {
+      CANFrame frame;
+      _can->packetFrame(frame);
+      forwardFrame(frame);
+    }
+  }
+
+  flush();
+}
+
+int SLCANAdapter::processCommand(const char* command, size_t length)
+{
+  bool ok = false;
+  uint32_t value;
+
+  switch (command[0]) {
+    case 'O':
+    case 'L':
+      ok = length == 1 && !_open && open(command[0] == 'L');
+      break;
+
+    case 'C':
+      if (length == 1 && _open) {
+        _can->end();
+        _open = false;
+        ok = true;
+      }
+      break;
+
+    case 'S':
+      if (length == 2 && !_open && command[1] >= '0' && command[1] <= '8' &&
+          SLCAN_BITRATES[command[1] - '0'] != 0) {
+        _bitrate = SLCAN_BITRATES[command[1] - '0'];
+        ok = true;
+      }
+      break;
+
+    case 'M':
+    case 'm':
+      // SJA1000 style acceptance code and mask, applied when the channel is
+      // opened.
+      if (length == 9 && !_open && parseHex(&command[1], 8, value)) {
+        if (command[0] == 'M') {
+          _acceptanceCode = value;
+        } else {
+          _acceptanceMask = value;
+        }
+        ok = true;
+      }
+      break;
+
+    case 't':
+    case 'T':
+    case 'r':
+    case 'R': {
+      CANFrame frame;
+      if (_open && !_listenOnly && parseFrame(command, length, frame)) {
+        ok = _can->sendFrame(frame);
+      }
+      if (ok) {
+        queue(command[0] == 't' || command[0] == 'r' ? "z\r" : "Z\r", 2);
+        return 1;
+      }
+      break;
+    }
+
+    case 'F':
+      if (length == 1 && _open) {
+        uint8_t flags = statusFlags();
+        char status[4] = { 'F', HEX_DIGITS[flags >> 4], HEX_DIGITS[flags & 0x0f], '\r' };
+        queue(status, sizeof(status));
+        return 1;
+      }
+      break;
+
+    case 'V':
+      if (length == 1) {
+        queue("V0101\r", 6);
+        return 1;
+      }
+      break;
+
+    case 'v':
+      if (length == 1) {
+        queue("v0101\r", 6);
+        return 1;
+      }
+      break;
+
+    case 'N':
+      if (length == 1) {
+        queue("NA001\r", 6);
+        return 1;
+      }
+      break;
+
+    case 'Z':
+      if (length == 2 && (command[1] == '0' || command[1] == '1')) {
+        _timestamps = command[1] == '1';
+        ok = true;
+      }
+      break;
+  }
+
+  reply(ok);
+  return ok ? 1 : 0;
+}
+
+void SLCANAdapter::forwardFrame(const CANFrame& frame)
+{
+  char encoded[SLCAN_MAX_FRAME_LENGTH];
+  // Lawicel timestamps are milliseconds, wrapping at 60000.
+  size_t length = encodeFrame(frame, _timestamps, millis() % 60000, encoded);
+  queue(encoded, length);
+}
+
+void SLCANAdapter::flush()
+{
+  if (_txLength == 0) {
+    return;
+  }
+
+  _serial->write((const uint8_t*)_txBuffer, _txLength);
+  _txLength = 0;
+}
+
+size_t SLCANAdapter::encodeFrame(const CANFrame& frame, bool withTimestamp, uint16_t timestamp, char* out)
+{
+  size_t n = 0;
+  uint8_t dlc = frame.dlc > 8 ? 8 : frame.dlc;
+
+  if (frame.extended) {
+    out[n++] = frame.rtr ? 'R' : 'T';
+    for (int shift = 28; shift >= 0; shift -= 4) {
+      out[n++] = HEX_DIGITS[(frame.id >> shift) & 0x0f];
+    }
+  } else {
+    out[n++] = frame.rtr ? 'r' : 't';
+    for (int shift = 8; shift >= 0; shift -= 4) {
+      out[n++] = HEX_DIGITS[(frame.id >> shift) & 0x0f];
+    }
+  }
+
+  out[n++] = '0' + dlc;
+
+  if (!frame.rtr) {
+    for (uint8_t i = 0; i < dlc; i++) {
+      out[n++] = HEX_DIGITS[frame.data[i] >> 4];
+      out[n++] = HEX_DIGITS[frame.data[i] & 0x0f];
+    }
+  }
+
+  if (withTimestamp) {
+    for (int shift = 12; shift >= 0; shift -= 4) {
+      out[n++] = HEX_DIGITS[(timestamp >> shift) & 0x0f];
+    }
+  }
+
+  out[n++] = '\r';
+
+  return n;
+}
+
+bool SLCANAdapter::parseFrame(const char* command, size_t length, CANFrame& frame)
+{
+  char type = command[0];
+  size_t idDigits;
+  if (type == 't' || type == 'r') {
+    idDigits = 3;
+    frame.extended = false;
+  } else if (type == 'T' || type == 'R') {
+    idDigits = 8;
+    frame.extended = true;
+  } else {
+    return false;
+  }
+  frame.rtr = (type == 'r' || type == 'R');
+
+  if (length < 1 + idDigits + 1) {
+    return false;
+  }
+
+  uint32_t value;
+  if (!parseHex(&command[1], idDigits, value)) {
+    return false;
+  }
+  if (value > (frame.extended ? 0x1fffffffUL : 0x7ffUL)) {
+    return false;
+  }
+  frame.id = value;
+
+  char dlc = command[1 + idDigits];
+  if (dlc < '0' || dlc > '8') {
+    return false;
+  }
+  frame.dlc = dlc - '0';
+
+  size_t dataDigits = frame.rtr ? 0 : frame.dlc * 2;
+  if (length != 1 + idDigits + 1 + dataDigits) {
+    return false;
+  }
+
+  memset(frame.data, 0x00, sizeof(frame.data));
+  const char* data = &command[1 + idDigits + 1];
+  for (uint8_t i = 0; i < dataDigits / 2; i++) {
+    if (!parseHex(&data[i * 2], 2, value)) {
+      return false;
+    }
+    frame.data[i] = value;
+  }
+
+  return true;
+}
+
+int SLCANAdapter::open(bool listenOnly)
+{
+  if (!_can->begin(_bitrate)) {
+    return 0;
+  }
+
+  // Only the standard ID part of the acceptance filter is supported. In the
+  // SJA1000 single filter layout the 11-bit ID occupies the top bits, and a
+  // set mask bit means "don't care".
+  if (_acceptanceMask != 0xffffffff) {
+    int id = (_acceptanceCode >> 21) & 0x7ff;
+    int mask = ~(_acceptanceMask >> 21) & 0x7ff;
+    if (!_can->filter(id & mask, mask)) {
+      _can->end();
+      return 0;
+    }
+  }
+
+  if (listenOnly && !_can->observe()) {
+    _can->end();
+    return 0;
+  }
+
+  _open = true;
+  _listenOnly = listenOnly;
+  _reportedOverflows = _can->rxOverflows();
+
+  return 1;
+}
+
+uint8_t SLCANAdapter::statusFlags()
+{
+  uint8_t flags = 0;
+
+  // The states include the ones before them: bus-off implies error passive,
+  // which implies error warning.
+  switch (_can->errorState()) {
+    case CAN_BUS_OFF:
+      flags |= SLCAN_FLAG_BUS_ERROR;
+      // fall through
+    case CAN_ERROR_PASSIVE:
+      flags |= SLCAN_FLAG_ERROR_PASSIVE;
+      // fall through
+    case CAN_ERROR_WARNING:
+      flags |= SLCAN_FLAG_ERROR_WARNING;
+      break;
+  }
+
+  // Overruns are reported once, like the latched flags of an SJA1000.
+  unsigned long overflows = _can->rxOverflows();
+  if (overflows != _reportedOverflows) {
+    flags |= SLCAN_FLAG_DATA_OVERRUN;
+    _reportedOverflows = overflows;
+  }
+
+  return flags;
+}
+
+void SLCANAdapter::queue(const char* data, size_t length)
+{
+  if (_txLength + length > sizeof(_txBuffer)) {
+    flush();
+  }
+
+  memcpy(&_txBuffer[_txLength], data, length);
+  _txLength += length;
+}
+
+void SLCANAdapter::reply(bool ok)
+{
+  char c = ok ? SLCAN_OK : SLCAN_ERROR;
+  queue(&c, 1);
+}
+
+bool SLCANAdapter::parseHex(const char* in, size_t digits, uint32_t& value)
+{
+  value = 0;
+  for (size_t i = 0; i < digits; i++) {
+    char c = in[i];
+    uint8_t nibble;
+    if (c >= '0' && c <= '9') {
+      nibble = c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+      nibble = c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+      nibble = c - 'a' + 10;
+    } else {
+      return false;
+    }
+    value = (value << 4) | nibble;
+  }
+
+  return true;
+}
@@ -0,0 +1,92 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef SLCAN_H
+#define SLCAN_H
+
+#include <Arduino.h>
+
+#include "CANController.h"
+
+// Output is collected in this buffer and written to the serial port in
+// batches. It holds at least one extended frame with timestamp (31).
+#define SLCAN_TX_BUFFER_SIZE       128
+
+// Upper bound on the number of received frames forwarded per poll(), so that
+// incoming commands are still served on a saturated bus.
+#ifndef SLCAN_MAX_FRAMES_PER_POLL
+#define SLCAN_MAX_FRAMES_PER_POLL 16
+#endif
+
+// Longest command: "T" + 8 ID digits + DLC + 16 data digits.
+#define SLCAN_MAX_COMMAND_LENGTH   26
+// Longest encoded frame: the above plus 4 timestamp digits and the CR.
+#define SLCAN_MAX_FRAME_LENGTH     31
+
+// Implements the SLCAN (Lawicel) serial protocol on top of a CAN controller,
+// so that the board can be used with slcand/can-utils, SavvyCAN and similar
+// PC tools:
+//
+//   slcand -o -s6 -t hw -S 1000000 /dev/ttyACM0 can0
+//
+// Supported commands: O, L, C, S0-S6, S8, M, m, t, T, r, R, F, V, v, N, Z.
+//
+// The adapter only talks to the CANControllerClass and Stream interfaces, so
+// processCommand() and encodeFrame() can be driven from a host-side build,
+// e.g. with a Stream wrapped around a pseudo-terminal.
+class SLCANAdapter {
+
+public:
+  SLCANAdapter(CANControllerClass& can, Stream& serial);
+
+  // Reads and executes pending commands, forwards received frames and writes
+  // the batched output. Call from loop().
+  void poll();
+
+  // Executes a single command (without the trailing CR) and queues the reply.
+  // Returns 1 if the command succeeded, 0 if it was answered with BELL.
+  int processCommand(const char* command, size_t length);
+
+  // Queues a received frame for the serial port.
+  void forwardFrame(const CANFrame& frame);
+  // Writes all queued output to the serial port.
+  void flush();
+
+  bool isOpen() const { return _open; }
+
+  // Encodes `frame` as an SLCAN frame ("t1232DEAD[tttt]\r") into `out`, which
+  // must hold SLCAN_MAX_FRAME_LENGTH characters. Returns the encoded length.
+  static size_t encodeFrame(const CANFrame& frame, bool withTimestamp, uint16_t timestamp, char* out);
+  // Parses a t/T/r/R transmit command. Returns false on malformed input.
+  static bool parseFrame(const char* command, size_t length, CANFrame& frame);
+
+private:
+  int open(bool listenOnly);
+  uint8_t statusFlags();
+  void queue(const char* data, size_t length);
+  void reply(bool ok);
+
+  static bool parseHex(const char* in, size_t digits, uint32_t& value);
+
+private:
+  CANControllerClass* _can;
+  Stream* _serial;
+
+  bool _open;
+  bool _listenOnly;
+  bool _timestamps;
+  long _bitrate;
+  uint32_t _acceptanceCode;
+  uint32_t _acceptanceMask;
+
+  char _command[SLCAN_MAX_COMMAND_LENGTH + 1];
+  size_t _commandLength;
+  bool _commandOverflow;
+
+  char _txBuffer[SLCAN_TX_BUFFER_SIZE];
+  size_t _txLength;
+
+  unsigned long _reportedOverflows;
+};
+
+#endif
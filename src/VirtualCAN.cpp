@@ -0,0 +1,781 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "VirtualCAN.h"
+
+// Error flag (6), error delimiter (8) and interframe space (3).
+#define ERROR_FRAME_BITS           17
+// CRC delimiter, ACK slot, ACK delimiter, end of frame and interframe space.
+#define FRAME_TRAILER_BITS         13
+// A bus-off node rejoins after 128 occurrences of 11 recessive bits.
+#define BUS_OFF_RECOVERY_BITS      (128 * 11)
+
+#define CRC15_POLYNOMIAL           0x4599
+
+// The stuffed bit stream of a frame, as far as its length is concerned.
+struct BitStream {
+  uint16_t bits;
+  uint8_t run;
+  bool last;
+  uint16_t crc;
+};
+
+static void putBits(BitStream& stream, uint32_t value, uint8_t count, bool crc)
+{
+  while (count--) {
+    bool bit = (value >> count) & 0x01;
+
+    if (crc) {
+      bool crcNext = bit ^ ((stream.crc >> 14) & 0x01);
+      stream.crc = (stream.crc << 1) & 0x7fff;
+      if (crcNext) {
+        stream.crc ^= CRC15_POLYNOMIAL;
+      }
+    }
+
+    if (stream.bits > 0 && bit == stream.last) {
+      stream.run++;
+    } else {
+      stream.run = 1;
+      stream.last = bit;
+    }
+    stream.bits++;
+
+    // After five equal bits, a bit of the opposite value is inserted, which
+    // starts the next run.
+    if (stream.run == 5) {
+      stream.bits++;
+      stream.last = !bit;
+      stream.run = 1;
+    }
+  }
+}
+
+static bool sameFrame(const CANFrame& a, const CANFrame& b)
+{
+  if (a.id != b.id || a.extended != b.extended || a.rtr != b.rtr || a.dlc != b.dlc) {
+    return false;
+  }
+
+  return a.rtr || memcmp(a.data, b.data, a.dlc > 8 ? 8 : a.dlc) == 0;
+}
+
+VirtualCANBus::VirtualCANBus() :
+  _baudRate(0),
+  _now(0),
+  _nodes(NULL),
+  _errorRate(0),
+  _random(1),
+  _injectedErrors(0)
+{
+  resetStatistics();
+}
+
+int VirtualCANBus::begin(long baudRate)
+{
+  if (baudRate <= 0) {
+    return 0;
+  }
+
+  _baudRate = baudRate;
+  _now = 0;
+  resetStatistics();
+
+  return 1;
+}
+
+void VirtualCANBus::end()
+{
+  while (_nodes) {
+    _nodes->end();
+  }
+
+  _baudRate = 0;
+}
+
+unsigned long VirtualCANBus::micros() const
+{
+  return bitsToMicros(_now);
+}
+
+void VirtualCANBus::run(unsigned long durationMicros)
+{
+  if (_baudRate == 0) {
+    return;
+  }
+
+  uint64_t end = _now + (uint64_t)durationMicros * _baudRate / 1000000;
+  while (_now < end) {
+    if (step()) {
+      continue;
+    }
+
+    // Skip the idle time, up to the next bus-off node rejoining.
+    uint64_t next = end;
+    for (VirtualCANClass* node = _nodes; node != NULL; node = node->_nextNode) {
+      if (node->_errorState == CAN_BUS_OFF && node->_busOffAt + BUS_OFF_RECOVERY_BITS < next) {
+        next = node->_busOffAt + BUS_OFF_RECOVERY_BITS;
+      }
+    }
+    _now = next;
+  }
+}
+
+bool VirtualCANBus::step()
+{
+  VirtualCANClass* winner = NULL;
+  uint32_t winnerKey = 0;
+
+  for (VirtualCANClass* node = _nodes; node != NULL; node = node->_nextNode) {
+    node->checkBusOffRecovery();
+
+    node->_presented = -1;
+    if (node->_txCount == 0 || !node->canAcknowledge()) {
+      continue;
+    }
+
+    node->_presented = node->nextTxBuffer();
+    uint32_t key = arbitrationKey(node->_txBuffers[node->_presented].frame);
+    if (winner == NULL || key < winnerKey) {
+      winner = node;
+      winnerKey = key;
+    }
+  }
+
+  if (winner == NULL) {
+    return false;
+  }
+
+  // Copied, as the TX buffer is freed on success.
+  CANFrame frame = winner->_txBuffers[winner->_presented].frame;
+  uint16_t bits = frameBitTimes(frame);
+
+  // A dominant bit overwrites a recessive one, so the lowest arbitration
+  // field wins. Nodes with the same arbitration field keep transmitting
+  // together, which only works out if their frames are identical.
+  bool collision = false;
+  bool acknowledged = false;
+  for (VirtualCANClass* node = _nodes; node != NULL; node = node->_nextNode) {
+    if (node->_presented >= 0 && arbitrationKey(node->_txBuffers[node->_presented].frame) != winnerKey) {
+      node->_presented = -1;
+      node->_arbitrationLosses++;
+      _arbitrationLosses++;
+    }
+
+    if (node->_presented < 0) {
+      acknowledged |= node->canAcknowledge();
+    } else if (!sameFrame(node->_txBuffers[node->_presented].frame, frame)) {
+      collision = true;
+    }
+  }
+
+  if (collision) {
+    // Detected as a bit error in the control or data field.
+    sendErrorFrame(frame.extended ? 39 : 19, false);
+  } else if (corruptNextFrame()) {
+    sendErrorFrame(1 + nextRandom() % (bits - 4), false);
+  } else if (!acknowledged) {
+    sendErrorFrame(bits - FRAME_TRAILER_BITS + 2, true);
+  } else {
+    transmit(frame, bits);
+  }
+
+  return true;
+}
+
+void VirtualCANBus::setErrorRate(unsigned long framesPerMillion, uint32_t seed)
+{
+  _errorRate = framesPerMillion;
+  _random = seed ? seed : 1;
+}
+
+float VirtualCANBus::busLoad() const
+{
+  uint64_t elapsed = _now - _statisticsStart;
+  if (elapsed == 0) {
+    return 0;
+  }
+
+  return (float)_busyBits / elapsed;
+}
+
+unsigned long VirtualCANBus::minLatency() const
+{
+  return _latencyCount ? bitsToMicros(_minLatency) : 0;
+}
+
+unsigned long VirtualCANBus::maxLatency() const
+{
+  return bitsToMicros(_maxLatency);
+}
+
+unsigned long VirtualCANBus::averageLatency() const
+{
+  return _latencyCount ? bitsToMicros(_sumLatency / _latencyCount) : 0;
+}
+
+unsigned long VirtualCANBus::latencyPercentile(uint8_t percent) const
+{
+  if (_latencyCount == 0) {
+    return 0;
+  }
+
+  uint64_t target = ((uint64_t)_latencyCount * (percent > 100 ? 100 : percent) + 99) / 100;
+  if (target == 0) {
+    target = 1;
+  }
+
+  uint64_t count = 0;
+  for (uint16_t i = 0; i < VIRTUAL_CAN_LATENCY_BUCKETS; i++) {
+    count += _latencyHistogram[i];
+    if (count >= target) {
+      uint32_t limit = latencyBucketLimit(i);
+      return bitsToMicros(limit < _maxLatency ? limit : _maxLatency);
+    }
+  }
+
+  return bitsToMicros(_maxLatency);
+}
+
+void VirtualCANBus::resetStatistics()
+{
+  _statisticsStart = _now;
+  _busyBits = 0;
+  _framesSent = 0;
+  _errorFrames = 0;
+  _arbitrationLosses = 0;
+  _minLatency = 0xffffffff;
+  _maxLatency = 0;
+  _sumLatency = 0;
+  _latencyCount = 0;
+  memset(_latencyHistogram, 0x00, sizeof(_latencyHistogram));
+}
+
+uint16_t VirtualCANBus::frameBitTimes(const CANFrame& frame)
+{
+  BitStream stream = { 0, 0, false, 0 };
+
+  putBits(stream, 0, 1, true);  // SOF
+  if (frame.extended) {
+    putBits(stream, frame.id >> 18, 11, true);
+    putBits(stream, 0x03, 2, true);  // SRR, IDE
+    putBits(stream, frame.id & 0x3ffff, 18, true);
+    putBits(stream, frame.rtr, 1, true);
+    putBits(stream, 0, 2, true);  // r1, r0
+  } else {
+    putBits(stream, frame.id, 11, true);
+    putBits(stream, frame.rtr, 1, true);
+    putBits(stream, 0, 2, true);  // IDE, r0
+  }
+  putBits(stream, frame.dlc & 0x0f, 4, true);
+
+  if (!frame.rtr) {
+    for (int i = 0; i < frame.dlc && i < 8; i++) {
+      putBits(stream, frame.data[i], 8, true);
+    }
+  }
+
+  putBits(stream, stream.crc, 15, false);
+
+  return stream.bits + FRAME_TRAILER_BITS;
+}
+
+void VirtualCANBus::attach(VirtualCANClass* node)
+{
+  // Appended, so that nodes are visited in the order they were started.
+  VirtualCANClass** last = &_nodes;
+  while (*last != NULL) {
+    last = &(*last)->_nextNode;
+  }
+
+  node->_nextNode = NULL;
+  *last = node;
+}
+
+void VirtualCANBus::detach(VirtualCANClass* node)
+{
+  for (VirtualCANClass** link = &_nodes; *link != NULL; link = &(*link)->_nextNode) {
+    if (*link == node) {
+      *link = node->_nextNode;
+      node->_nextNode = NULL;
+      return;
+    }
+  }
+}
+
+void VirtualCANBus::transmit(const CANFrame& frame, uint16_t bits)
+{
+  _now += bits;
+  _busyBits += bits;
+  _framesSent++;
+
+  for (VirtualCANClass* node = _nodes; node != NULL; node = node->_nextNode) {
+    if (node->_presented >= 0) {
+      recordLatency(node->_txBuffers[node->_presented].queuedAt);
+      node->removeTxBuffer(node->_presented);
+      node->_presented = -1;
+      node->transmitSuccess();
+    } else if (node->canReceive()) {
+      node->receiveSuccess();
+      node->receive(frame);
+    }
+  }
+}
+
+void VirtualCANBus::sendErrorFrame(uint16_t errorBit, bool ackError)
+{
+  uint16_t bits = errorBit + ERROR_FRAME_BITS;
+  _now += bits;
+  _busyBits += bits;
+  _errorFrames++;
+
+  for (VirtualCANClass* node = _nodes; node != NULL; node = node->_nextNode) {
+    if (node->_presented >= 0) {
+      // An error passive transmitter does not count missing ACKs, so that a
+      // node alone on the bus does not go bus-off.
+      if (!ackError || node->_errorState != CAN_ERROR_PASSIVE) {
+        node->transmitError();
+      }
+      node->_presented = -1;
+    } else if (!ackError && node->canAcknowledge()) {
+      node->receiveError();
+    }
+  }
+}
+
+void VirtualCANBus::recordLatency(uint64_t queuedAt)
+{
+  uint64_t latency = _now - queuedAt;
+  uint32_t bits = latency > 0xffffffff ? 0xffffffff : (uint32_t)latency;
+
+  if (bits < _minLatency) {
+    _minLatency = bits;
+  }
+  if (bits > _maxLatency) {
+    _maxLatency = bits;
+  }
+  _sumLatency += bits;
+  _latencyCount++;
+  _latencyHistogram[latencyBucket(bits)]++;
+}
+
+bool VirtualCANBus::corruptNextFrame()
+{
+  if (_injectedErrors > 0) {
+    _injectedErrors--;
+    return true;
+  }
+
+  return _errorRate > 0 && (nextRandom() % 1000000) < _errorRate;
+}
+
+uint32_t VirtualCANBus::nextRandom()
+{
+  // xorshift32
+  _random ^= _random << 13;
+  _random ^= _random >> 17;
+  _random ^= _random << 5;
+
+  return _random;
+}
+
+unsigned long VirtualCANBus::bitsToMicros(uint64_t bits) const
+{
+  if (_baudRate == 0) {
+    return 0;
+  }
+
+  return (unsigned long)(bits * 1000000 / _baudRate);
+}
+
+uint32_t VirtualCANBus::arbitrationKey(const CANFrame& frame)
+{
+  // The arbitration field, left aligned so that comparing keys compares the
+  // bits in the order they are sent.
+  if (frame.extended) {
+    return ((uint32_t)(frame.id >> 18) << 21) | (0x03UL << 19) |
+        ((uint32_t)(frame.id & 0x3ffff) << 1) | (frame.rtr ? 1 : 0);
+  }
+
+  return ((uint32_t)frame.id << 21) | (frame.rtr ? (1UL << 20) : 0);
+}
+
+uint16_t VirtualCANBus::latencyBucket(uint32_t bits)
+{
+  if (bits < 8) {
+    return bits;
+  }
+
+  uint8_t exponent = 31;
+  while (!(bits & (1UL << exponent))) {
+    exponent--;
+  }
+
+  return (exponent - 2) * 8 + ((bits >> (exponent - 3)) & 0x07);
+}
+
+uint32_t VirtualCANBus::latencyBucketLimit(uint16_t bucket)
+{
+  if (bucket < 8) {
+    return bucket;
+  }
+
+  uint8_t shift = bucket / 8 - 1;
+  uint32_t lower = (uint32_t)(8 + bucket % 8) << shift;
+
+  return lower + ((1UL << shift) - 1);
+}
+
+VirtualCANClass::VirtualCANClass(VirtualCANBus& bus) :
+  CANControllerClass(),
+  _bus(&bus),
+  _nextNode(NULL),
+  _attached(false),
+  _mode(MODE_NORMAL),
+  _filterId(0),
+  _filterMask(0),
+  _filterExtended(false),
+  _filtering(false),
+  _rxLimit(2),
+  _txLimit(3),
+  _rxHead(0),
+  _rxCount(0),
+  _txCount(0),
+  _presented(-1),
+  _errorState(CAN_ERROR_ACTIVE),
+  _tec(0),
+  _rec(0),
+  _busOffAt(0),
+  _framesSent(0),
+  _framesReceived(0),
+  _rxOverflows(0),
+  _arbitrationLosses(0)
+{
+}
+
+VirtualCANClass::~VirtualCANClass()
+{
+  end();
+}
+
+int VirtualCANClass::begin(long baudRate)
+{
+  CANControllerClass::begin(baudRate);
+
+  if (_bus->baudRate() == 0 || baudRate != _bus->baudRate()) {
+    return 0;
+  }
+
+  _mode = MODE_NORMAL;
+  _filtering = false;
+  _rxHead = 0;
+  _rxCount = 0;
+  _txCount = 0;
+  _presented = -1;
+
+  _errorState = CAN_ERROR_ACTIVE;
+  _tec = 0;
+  _rec = 0;
+
+  _framesSent = 0;
+  _framesReceived = 0;
+  _rxOverflows = 0;
+  _arbitrationLosses = 0;
+
+  if (!_attached) {
+    _bus->attach(this);
+    _attached = true;
+  }
+
+  return 1;
+}
+
+void VirtualCANClass::end()
+{
+  if (_attached) {
+    _bus->detach(this);
+    _attached = false;
+  }
+
+  CANControllerClass::end();
+}
+
+int VirtualCANClass::endPacket()
+{
+  if (!CANControllerClass::endPacket()) {
+    return 0;
+  }
+
+  if (!_attached || _mode == MODE_LISTEN_ONLY || _mode == MODE_SLEEP) {
+    return 0;
+  }
+
+  CANFrame frame;
+  frame.id = _txId;
+  frame.extended = _txExtended;
+  frame.rtr = _txRtr;
+  frame.dlc = _txLength;
+  memcpy(frame.data, _txData, sizeof(frame.data));
+
+  if (_mode == MODE_LOOPBACK) {
+    _framesSent++;
+    receive(frame);
+    return 1;
+  }
+
+  checkBusOffRecovery();
+  if (_errorState == CAN_BUS_OFF || _txCount >= _txLimit) {
+    return 0;
+  }
+
+  TxBuffer& buffer = _txBuffers[_txCount++];
+  buffer.frame = frame;
+  buffer.queuedAt = _bus->bitTimes();
+
+  return 1;
+}
+
+int VirtualCANClass::parsePacket()
+{
+  // Frames consumed by the receive hooks (e.g. a mailbox) are skipped.
+  while (_rxCount > 0) {
+    const CANFrame& frame = _rxBuffers[_rxHead];
+    _rxHead = (_rxHead + 1) % VIRTUAL_CAN_MAX_RX_BUFFERS;
+    _rxCount--;
+
+    _rxId = frame.id;
+    _rxExtended = frame.extended;
+    _rxRtr = frame.rtr;
+    _rxDlc = frame.dlc;
+    _rxLength = frame.rtr ? 0 : (frame.dlc > 8 ? 8 : frame.dlc);
+    _rxIndex = 0;
+    memcpy(_rxData, frame.data, _rxLength);
+
+    if (deliverPacket()) {
+      return _rxDlc;
+    }
+  }
+
+  _rxId = -1;
+  _rxExtended = false;
+  _rxRtr = false;
+  _rxDlc = 0;
+  _rxIndex = 0;
+  _rxLength = 0;
+
+  return 0;
+}
+
+void VirtualCANClass::onReceive(void(*callback)(int))
+{
+  CANControllerClass::onReceive(callback);
+
+  // Frames received before the callback was set would otherwise wait for
+  // the next one.
+  if (callback) {
+    handleReceive();
+  }
+}
+
+int VirtualCANClass::filter(int id, int mask)
+{
+  id &= 0x7ff;
+  mask &= 0x7ff;
+
+  _filtering = true;
+  _filterId = id & mask;
+  _filterMask = mask;
+  _filterExtended = false;
+
+  return 1;
+}
+
+int VirtualCANClass::filterExtended(long id, long mask)
+{
+  id &= 0x1FFFFFFF;
+  mask &= 0x1FFFFFFF;
+
+  _filtering = true;
+  _filterId = id & mask;
+  _filterMask = mask;
+  _filterExtended = true;
+
+  return 1;
+}
+
+bool VirtualCANClass::switchToNormalMode()
+{
+  _mode = MODE_NORMAL;
+
+  return true;
+}
+
+int VirtualCANClass::observe()
+{
+  _mode = MODE_LISTEN_ONLY;
+
+  return 1;
+}
+
+int VirtualCANClass::loopback()
+{
+  _mode = MODE_LOOPBACK;
+
+  return 1;
+}
+
+int VirtualCANClass::sleep()
+{
+  _mode = MODE_SLEEP;
+
+  return 1;
+}
+
+int VirtualCANClass::wakeup()
+{
+  _mode = MODE_NORMAL;
+
+  return 1;
+}
+
+void VirtualCANClass::setBufferLimits(uint8_t rxBuffers, uint8_t txBuffers)
+{
+  _rxLimit = rxBuffers > VIRTUAL_CAN_MAX_RX_BUFFERS ? VIRTUAL_CAN_MAX_RX_BUFFERS : rxBuffers;
+  _txLimit = txBuffers > VIRTUAL_CAN_MAX_TX_BUFFERS ? VIRTUAL_CAN_MAX_TX_BUFFERS : txBuffers;
+}
+
+bool VirtualCANClass::canAcknowledge() const
+{
+  return _attached && _mode == MODE_NORMAL && _errorState != CAN_BUS_OFF;
+}
+
+bool VirtualCANClass::canReceive() const
+{
+  return _attached && (_mode == MODE_NORMAL || _mode == MODE_LISTEN_ONLY) && _errorState != CAN_BUS_OFF;
+}
+
+int VirtualCANClass::nextTxBuffer()
+{
+  // Highest priority first, then oldest first.
+  int next = 0;
+  for (int n = 1; n < _txCount; n++) {
+    if (VirtualCANBus::arbitrationKey(_txBuffers[n].frame) < VirtualCANBus::arbitrationKey(_txBuffers[next].frame)) {
+      next = n;
+    }
+  }
+
+  return next;
+}
+
+void VirtualCANClass::removeTxBuffer(int n)
+{
+  for (int i = n + 1; i < _txCount; i++) {
+    _txBuffers[i - 1] = _txBuffers[i];
+  }
+  _txCount--;
+}
+
+bool VirtualCANClass::accepts(const CANFrame& frame) const
+{
+  if (!_filtering) {
+    return true;
+  }
+
+  return frame.extended == _filterExtended && (frame.id & _filterMask) == _filterId;
+}
+
+void VirtualCANClass::receive(const CANFrame& frame)
+{
+  if (!accepts(frame)) {
+    return;
+  }
+
+  if (_rxCount >= _rxLimit) {
+    _rxOverflows++;
+    return;
+  }
+
+  _rxBuffers[(_rxHead + _rxCount) % VIRTUAL_CAN_MAX_RX_BUFFERS] = frame;
+  _rxCount++;
+  _framesReceived++;
+
+  if (_onReceive) {
+    handleReceive();
+  }
+}
+
+void VirtualCANClass::handleReceive()
+{
+  // parsePacket() runs the per-ID handlers; only the remaining frames reach
+  // the callback.
+  while (parsePacket()) {
+    if (_onReceive) {
+      _onReceive(available());
+    }
+  }
+}
+
+void VirtualCANClass::transmitError()
+{
+  _tec += 8;
+  updateErrorState();
+}
+
+void VirtualCANClass::transmitSuccess()
+{
+  _framesSent++;
+  if (_tec > 0) {
+    _tec--;
+  }
+  updateErrorState();
+}
+
+void VirtualCANClass::receiveError()
+{
+  if (_rec < 255) {
+    _rec++;
+  }
+  updateErrorState();
+}
+
+void VirtualCANClass::receiveSuccess()
+{
+  if (_mode != MODE_NORMAL) {
+    return;
+  }
+
+  // An error passive receiver goes back to a count between 119 and 127.
+  if (_rec > 127) {
+    _rec = 127;
+  } else if (_rec > 0) {
+    _rec--;
+  }
+  updateErrorState();
+}
+
+void VirtualCANClass::updateErrorState()
+{
+  if (_errorState == CAN_BUS_OFF) {
+    return;
+  }
+
+  if (_tec > 255) {
+    _errorState = CAN_BUS_OFF;
+    _busOffAt = _bus->bitTimes();
+  } else if (_tec >= 128 || _rec >= 128) {
+    _errorState = CAN_ERROR_PASSIVE;
+  } else if (_tec >= 96 || _rec >= 96) {
+    _errorState = CAN_ERROR_WARNING;
+  } else {
+    _errorState = CAN_ERROR_ACTIVE;
+  }
+}
+
+void VirtualCANClass::checkBusOffRecovery()
+{
+  if (_errorState == CAN_BUS_OFF && _bus->bitTimes() - _busOffAt >= BUS_OFF_RECOVERY_BITS) {
+    _tec = 0;
+    _rec = 0;
+    _errorState = CAN_ERROR_ACTIVE;
+  }
+}
@@ -0,0 +1,236 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef VIRTUAL_CAN_H
+#define VIRTUAL_CAN_H
+
+#include <Arduino.h>
+
+#include "CANController.h"
+
+// Upper bounds for setBufferLimits(). They size the buffers of each node, so
+// they are fixed.
+#define VIRTUAL_CAN_MAX_RX_BUFFERS 16
+#define VIRTUAL_CAN_MAX_TX_BUFFERS 8
+
+// Latency histogram: 8 buckets per power of two, covering 32-bit bit times.
+#define VIRTUAL_CAN_LATENCY_BUCKETS 240
+
+class VirtualCANClass;
+
+// An in-memory CAN bus shared by VirtualCANClass nodes, for simulating whole
+// networks on a single board, without CAN hardware.
+//
+// Time is simulated: it only advances in run() and step(), by the exact
+// length of the frames on the bus (including stuff bits) at the configured
+// baud rate, so simulations run as fast as the board allows. Frames are
+// arbitrated bit by bit like on a real bus, and the error counters and states
+// of the nodes follow the CAN specification.
+//
+//   VirtualCANBus bus;
+//   VirtualCANClass engine(bus);
+//   VirtualCANClass gateway(bus);
+//
+//   bus.begin(500E3);
+//   engine.begin(500E3);
+//   gateway.begin(500E3);
+//
+//   while (bus.micros() < 10000000) {
+//     ...                                 // let the nodes queue frames
+//     bus.run(1000);
+//   }
+//   Serial.println(bus.busLoad());
+class VirtualCANBus {
+
+public:
+  VirtualCANBus();
+
+  int begin(long baudRate);
+  void end();
+  long baudRate() const { return _baudRate; }
+
+  // Simulated time since begin(), in bit times and in microseconds.
+  uint64_t bitTimes() const { return _now; }
+  unsigned long micros() const;
+
+  // Transmits frames until at least `durationMicros` of bus time have passed;
+  // the last frame may end a little later. Idle time is skipped.
+  void run(unsigned long durationMicros);
+  // Transmits the winner of the next arbitration, or sends an error frame.
+  // Returns false if no node has anything to send.
+  bool step();
+
+  // Corrupts on average `framesPerMillion` of every million frames, at a
+  // random bit. The sequence is reproducible for a given seed.
+  void setErrorRate(unsigned long framesPerMillion, uint32_t seed = 1);
+  // Corrupts the next `count` frames.
+  void injectErrors(unsigned long count) { _injectedErrors += count; }
+
+  unsigned long framesSent() const { return _framesSent; }
+  unsigned long errorFrames() const { return _errorFrames; }
+  unsigned long arbitrationLosses() const { return _arbitrationLosses; }
+  // Share of the time the bus was busy since begin() or resetStatistics(),
+  // between 0 and 1.
+  float busLoad() const;
+  // Time from endPacket() to the end of the frame on the bus, in
+  // microseconds. Percentiles have a resolution of 1/8 of their value.
+  unsigned long minLatency() const;
+  unsigned long maxLatency() const;
+  unsigned long averageLatency() const;
+  unsigned long latencyPercentile(uint8_t percent) const;
+  void resetStatistics();
+
+  // Length of `frame` on the bus in bit times, including stuff bits and the
+  // interframe space.
+  static uint16_t frameBitTimes(const CANFrame& frame);
+
+private:
+  friend class VirtualCANClass;
+
+  void attach(VirtualCANClass* node);
+  void detach(VirtualCANClass* node);
+
+  void transmit(const CANFrame& frame, uint16_t bits);
+  void sendErrorFrame(uint16_t errorBit, bool ackError);
+  void recordLatency(uint64_t queuedAt);
+  bool corruptNextFrame();
+  uint32_t nextRandom();
+  unsigned long bitsToMicros(uint64_t bits) const;
+
+  static uint32_t arbitrationKey(const CANFrame& frame);
+  static uint16_t latencyBucket(uint32_t bits);
+  static uint32_t latencyBucketLimit(uint16_t bucket);
+
+private:
+  long _baudRate;
+  uint64_t _now;
+  VirtualCANClass* _nodes;
+
+  unsigned long _errorRate;
+  uint32_t _random;
+  unsigned long _injectedErrors;
+
+  uint64_t _statisticsStart;
+  uint64_t _busyBits;
+  unsigned long _framesSent;
+  unsigned long _errorFrames;
+  unsigned long _arbitrationLosses;
+  uint32_t _minLatency;
+  uint32_t _maxLatency;
+  uint64_t _sumLatency;
+  unsigned long _latencyCount;
+  uint32_t _latencyHistogram[VIRTUAL_CAN_LATENCY_BUCKETS];
+};
+
+// A CAN controller attached to a VirtualCANBus, with the same API as the
+// MCP2515 driver.
+//
+// endPacket() queues the frame and returns right away; it is sent during the
+// next VirtualCANBus::run(). Received frames are reported through
+// parsePacket(), or to the onReceive() callback from within run(). A node
+// presents its highest priority queued frame to the arbitration.
+class VirtualCANClass : public CANControllerClass {
+
+public:
+  explicit VirtualCANClass(VirtualCANBus& bus);
+  virtual ~VirtualCANClass();
+
+  // Fails if `baudRate` differs from the one of the bus.
+  virtual int begin(long baudRate);
+  virtual void end();
+
+  virtual int endPacket();
+
+  virtual int parsePacket();
+
+  using CANControllerClass::onReceive;
+  virtual void onReceive(void(*callback)(int));
+
+  using CANControllerClass::filter;
+  virtual int filter(int id, int mask);
+  using CANControllerClass::filterExtended;
+  virtual int filterExtended(long id, long mask);
+
+  bool switchToNormalMode();
+  virtual int observe();
+  virtual int loopback();
+  virtual int sleep();
+  virtual int wakeup();
+
+  // Number of frames the node can hold; frames received while all RX buffers
+  // are full are lost. Defaults to the 2 RX and 3 TX buffers of the MCP2515.
+  void setBufferLimits(uint8_t rxBuffers, uint8_t txBuffers);
+  int pendingTx() const { return _txCount; }
+
+  virtual int errorState() const { return _errorState; }
+  int transmitErrorCount() const { return _tec; }
+  int receiveErrorCount() const { return _rec; }
+
+  unsigned long framesSent() const { return _framesSent; }
+  unsigned long framesReceived() const { return _framesReceived; }
+  virtual unsigned long rxOverflows() const { return _rxOverflows; }
+  unsigned long arbitrationLosses() const { return _arbitrationLosses; }
+
+private:
+  friend class VirtualCANBus;
+
+  enum Mode {
+    MODE_NORMAL,
+    MODE_LISTEN_ONLY,
+    MODE_LOOPBACK,
+    MODE_SLEEP
+  };
+
+  struct TxBuffer {
+    CANFrame frame;
+    uint64_t queuedAt;
+  };
+
+  bool canAcknowledge() const;
+  bool canReceive() const;
+  int nextTxBuffer();
+  void removeTxBuffer(int n);
+  bool accepts(const CANFrame& frame) const;
+  void receive(const CANFrame& frame);
+  void handleReceive();
+
+  void transmitError();
+  void transmitSuccess();
+  void receiveError();
+  void receiveSuccess();
+  void updateErrorState();
+  void checkBusOffRecovery();
+
+private:
+  VirtualCANBus* _bus;
+  VirtualCANClass* _nextNode;
+  bool _attached;
+  Mode _mode;
+
+  long _filterId;
+  long _filterMask;
+  bool _filterExtended;
+  bool _filtering;
+
+  uint8_t _rxLimit;
+  uint8_t _txLimit;
+  CANFrame _rxBuffers[VIRTUAL_CAN_MAX_RX_BUFFERS];
+  uint8_t _rxHead;
+  uint8_t _rxCount;
+  TxBuffer _txBuffers[VIRTUAL_CAN_MAX_TX_BUFFERS];
+  uint8_t _txCount;
+  // The TX buffer taking part in the current arbitration, or -1.
+  int _presented;
+
+  int _errorState;
+  int _tec;
+  int _rec;
+  uint64_t _busOffAt;
+
+  unsigned long _framesSent;
+  unsigned long _framesReceived;
+  unsigned long _rxOverflows;
+  unsigned long _arbitrationLosses;
+};
+
+#endif